@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ansi.h"
+
+// A reduced form of the DEC VT500 parser: enough to recognise where every
+// sequence ends, without interpreting any of them.
+enum { GROUND, ESCAPE, ESCAPE_INTERMEDIATE, CSI, STRING, STATES };
+
+// Byte classes
+enum {
+	OR, // ordinary (bytes >= 0x80)
+	C0, // other control characters
+	ES, // ESC
+	BL, // BEL, which also ends an OSC string
+	LF, // newline, which aborts any sequence
+	CN, // CAN and SUB cancel a sequence
+	IN, // intermediate bytes 0x20-0x2f
+	PA, // parameter bytes 0x30-0x3f
+	FI, // final bytes 0x40-0x7e
+	CI, // '[' introduces a CSI
+	SI, // ']', 'P', 'X', '^' and '_' introduce OSC, DCS, SOS, PM and APC strings
+	CLASSES
+};
+
+static const unsigned char classes[256] = {
+	C0,C0,C0,C0,C0,C0,C0,BL,C0,C0,LF,C0,C0,C0,C0,C0,
+	C0,C0,C0,C0,C0,C0,C0,C0,CN,C0,CN,ES,C0,C0,C0,C0,
+	IN,IN,IN,IN,IN,IN,IN,IN,IN,IN,IN,IN,IN,IN,IN,IN,
+	PA,PA,PA,PA,PA,PA,PA,PA,PA,PA,PA,PA,PA,PA,PA,PA,
+	FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,
+	SI,FI,FI,FI,FI,FI,FI,FI,SI,FI,FI,CI,FI,SI,SI,SI,
+	FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,
+	FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,FI,C0,
+	OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,
+	OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,
+	OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,
+	OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,
+	OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,
+	OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,
+	OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,
+	OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,OR,
+};
+
+#define KEEP 0x80 // the byte is part of the clean text
+
+#define MAX_SIZE(x, y) (x > y ? x : y)
+
+static const unsigned char transitions[STATES][CLASSES] = {
+	/*                   OR           C0                        ES      BL                   LF           CN           IN                   PA           FI           CI           SI */
+	/* ground       */ { GROUND|KEEP, GROUND|KEEP,              ESCAPE, GROUND|KEEP,         GROUND|KEEP, GROUND|KEEP, GROUND|KEEP,         GROUND|KEEP, GROUND|KEEP, GROUND|KEEP, GROUND|KEEP },
+	/* escape       */ { GROUND|KEEP, ESCAPE|KEEP,              ESCAPE, GROUND,              GROUND|KEEP, GROUND,      ESCAPE_INTERMEDIATE, GROUND,      GROUND,      CSI,         STRING },
+	/* intermediate */ { GROUND|KEEP, ESCAPE_INTERMEDIATE|KEEP, ESCAPE, ESCAPE_INTERMEDIATE, GROUND|KEEP, GROUND,      ESCAPE_INTERMEDIATE, GROUND,      GROUND,      GROUND,      GROUND },
+	/* csi          */ { GROUND|KEEP, CSI|KEEP,                 ESCAPE, CSI,                 GROUND|KEEP, GROUND,      CSI,                 CSI,         GROUND,      GROUND,      GROUND },
+	/* string       */ { STRING,      STRING,                   ESCAPE, GROUND,              GROUND|KEEP, GROUND,      STRING,              STRING,      STRING,      STRING,      STRING },
+};
+
+void
+shadow_init (shadow_t* shadow)
+{
+	memset(shadow, 0, sizeof(*shadow));
+}
+
+void
+shadow_clear (shadow_t* shadow)
+{
+	shadow->nmemb = 0;
+	shadow->raw = 0;
+	shadow->state = GROUND;
+	shadow->njumps = 0;
+}
+
+void
+shadow_free (shadow_t* shadow)
+{
+	free(shadow->v);
+	free(shadow->jumps);
+	memset(shadow, 0, sizeof(*shadow));
+}
+
+// Records where the clean text next continues in the original, if the
+// bytes dropped since the last jump have moved it.
+static void
+add_jump (shadow_t* shadow, size_t clean, size_t raw)
+{
+	struct ansi_jump* last = shadow->njumps ? &shadow->jumps[shadow->njumps-1] : NULL;
+
+	if ((last ? last->raw - last->clean : 0) == raw - clean)
+		return;
+
+	if (shadow->njumps == shadow->jump_size) {
+		shadow->jump_size = shadow->jump_size ? shadow->jump_size*2 : BUFSIZ;
+		shadow->jumps = realloc(shadow->jumps, shadow->jump_size*sizeof(*shadow->jumps));
+		if (!shadow->jumps) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	shadow->jumps[shadow->njumps].clean = clean;
+	shadow->jumps[shadow->njumps].raw = raw;
+	++shadow->njumps;
+}
+
+void
+ansi_strip (shadow_t* shadow, const char* s, size_t length)
+{
+	const char* end = s + length;
+	const char* esc;
+	unsigned char t;
+	size_t n;
+
+	// The clean text is never longer than the original
+	if (shadow->size < shadow->nmemb + length + 1) {
+		shadow->size = MAX_SIZE(shadow->size*2, shadow->nmemb + length + 1);
+		shadow->v = realloc(shadow->v, shadow->size);
+		if (!shadow->v) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	while (s < end)
+	{
+		// Most output is plain text, which we copy up to the next escape
+		if (shadow->state == GROUND) {
+			esc = memchr(s, '\033', end - s);
+			n = (esc ? esc : end) - s;
+			if (n > 0) {
+				add_jump(shadow, shadow->nmemb, shadow->raw);
+				memcpy(shadow->v + shadow->nmemb, s, n);
+				shadow->nmemb += n;
+				shadow->raw += n;
+				s += n;
+			}
+			if (!esc)
+				break;
+		}
+
+		t = transitions[shadow->state][classes[(unsigned char)*s]];
+		if (t & KEEP) {
+			add_jump(shadow, shadow->nmemb, shadow->raw);
+			shadow->v[shadow->nmemb++] = *s;
+		}
+		shadow->state = t & ~KEEP;
+		++shadow->raw;
+		++s;
+	}
+
+	shadow->v[shadow->nmemb] = '\0';
+}
+
+size_t
+shadow_raw_start (shadow_t* shadow, size_t clean)
+{
+	size_t lo = 0, hi = shadow->njumps;
+
+	// Find the last jump at or before the offset
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (shadow->jumps[mid].clean <= clean)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		return clean;
+
+	return shadow->jumps[lo-1].raw + (clean - shadow->jumps[lo-1].clean);
+}
+
+size_t
+shadow_raw_stop (shadow_t* shadow, size_t clean)
+{
+	if (clean == 0)
+		return 0;
+
+	return shadow_raw_start(shadow, clean-1) + 1;
+}
+
+const char*
+ansi_skip (const char* s)
+{
+	int state = GROUND;
+	unsigned char t;
+
+	if (*s != '\033')
+		return s;
+
+	while (*s != '\0')
+	{
+		t = transitions[state][classes[(unsigned char)*s]];
+
+		// A byte which aborts the sequence isn’t part of it
+		if ((t & KEEP) && (t & ~KEEP) == GROUND)
+			return s;
+
+		state = t & ~KEEP;
+		++s;
+
+		if (state == GROUND)
+			break;
+	}
+
+	return s;
+}
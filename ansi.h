@@ -0,0 +1,42 @@
+#ifndef ANSI_H
+#define ANSI_H
+
+#include <stddef.h>
+
+// A copy of terminal output with escape sequences (CSI, OSC, DCS, charset
+// selection, etc.) removed, and a map from offsets in the copy back to the
+// original.  The map has one entry per removed sequence, so plain output
+// costs nothing beyond the copy.
+typedef struct {
+	char *v;
+	size_t nmemb;
+	size_t size;
+
+	size_t raw;          // number of raw bytes consumed
+	int state;           // parser state between calls to ansi_strip
+
+	struct ansi_jump {
+		size_t clean;    // offset in v
+		size_t raw;      // corresponding offset in the original
+	} *jumps;
+	size_t njumps;
+	size_t jump_size;
+} shadow_t;
+
+void shadow_init (shadow_t* shadow);
+void shadow_free (shadow_t* shadow);
+
+// Empties the shadow for reuse, keeping its memory
+void shadow_clear (shadow_t* shadow);
+
+// Appends the next length bytes of raw output; sequences may span calls
+void ansi_strip (shadow_t* shadow, const char* s, size_t length);
+
+// Offsets in the original for the first byte of, and just past, a range in v
+size_t shadow_raw_start (shadow_t* shadow, size_t clean);
+size_t shadow_raw_stop (shadow_t* shadow, size_t clean);
+
+// Skips the escape sequence starting at s, stopping early at a newline or NUL
+const char* ansi_skip (const char* s);
+
+#endif
@@ -0,0 +1,366 @@
+// For struct ucred, to ask the socket who's listening
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "daemon.h"
+#include "gitindex.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // SO_NOSIGPIPE is set instead
+#endif
+
+// Each request and reply is a line of lengths, then the strings:
+//   <dir length> <path length>\n<dir><path>
+//   <count> <root length> <file length>\n<root><file>
+
+int
+daemon_socket (char path[PATH_MAX])
+{
+	const char* env;
+	char dir[32];
+	struct stat st;
+
+	if ((env = getenv("PLS_SOCKET")) && *env) {
+		snprintf(path, PATH_MAX, "%s", env);
+		return 1;
+	}
+	if ((env = getenv("XDG_RUNTIME_DIR")) && *env) {
+		snprintf(path, PATH_MAX, "%s/pls.sock", env);
+		return 1;
+	}
+
+	// Anyone can make the directory in /tmp first, so it's only used if
+	// it's this user's and no one else's
+	snprintf(dir, sizeof(dir), "/tmp/pls-%d", (int)getuid());
+	snprintf(path, PATH_MAX, "%s/pls.sock", dir);
+	mkdir(dir, 0700);
+	return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) &&
+	       st.st_uid == getuid() && (st.st_mode & 077) == 0;
+}
+
+static int
+address (struct sockaddr_un* sa, const char* path)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa->sun_path))
+		return 0;
+	strcpy(sa->sun_path, path);
+	return 1;
+}
+
+// Whether what's listening on the other end of fd runs as this user, since
+// a socket could have been left where it's looked for by anyone
+static int
+trusted (int fd, const char* path)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t length = sizeof(cred);
+
+	(void)path;
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0 && cred.uid == getuid();
+#else
+	struct stat st;
+
+	(void)fd;
+	return stat(path, &st) == 0 && st.st_uid == getuid();
+#endif
+}
+
+// Reads and writes the socket through a stream each way
+static int
+attach (daemon_t* daemon, int fd)
+{
+	int copy = dup(fd);
+
+	daemon->in = fdopen(fd, "r");
+	daemon->out = copy < 0 ? NULL : fdopen(copy, "w");
+	if (!daemon->in || !daemon->out) {
+		if (daemon->in)
+			fclose(daemon->in);
+		else
+			close(fd);
+		if (daemon->out)
+			fclose(daemon->out);
+		else if (copy >= 0)
+			close(copy);
+		return 0;
+	}
+	return 1;
+}
+
+int
+daemon_connect (daemon_t* daemon)
+{
+	char path[PATH_MAX];
+	struct sockaddr_un sa;
+	struct timeval timeout;
+	int fd;
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+#endif
+
+	if (!daemon_socket(path) || !address(&sa, path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 0;
+
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || !trusted(fd, path)) {
+		close(fd);
+		return 0;
+	}
+
+	// A plsd that's hung is given up on rather than waited for
+	timeout.tv_sec = DAEMON_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+	return attach(daemon, fd);
+}
+
+void
+daemon_close (daemon_t* daemon)
+{
+	if (daemon->in)
+		fclose(daemon->in);
+	if (daemon->out)
+		fclose(daemon->out);
+	memset(daemon, 0, sizeof(*daemon));
+}
+
+// Reads n bytes into a string of up to PATH_MAX
+static int
+read_string (FILE* in, char s[PATH_MAX], size_t n)
+{
+	if (n >= PATH_MAX || fread(s, 1, n, in) != n)
+		return 0;
+	s[n] = '\0';
+	return 1;
+}
+
+// Sends the whole of s, without being killed by SIGPIPE if plsd has gone
+static int
+send_all (int fd, const char* s, size_t n)
+{
+	ssize_t sent;
+
+	while (n > 0) {
+		if ((sent = send(fd, s, n, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return 0;
+		s += sent;
+		n -= sent;
+	}
+	return 1;
+}
+
+long
+daemon_find (daemon_t* daemon, const char* dir, const char* path, size_t length,
+             char root[PATH_MAX], char file[PATH_MAX])
+{
+	char request[64 + 2*PATH_MAX];
+	size_t count, nroot, nfile, ndir = strlen(dir), n;
+
+	if (ndir >= PATH_MAX || length >= PATH_MAX)
+		return 0;
+	n = snprintf(request, sizeof(request), "%zu %zu\n", ndir, length);
+	memcpy(request + n, dir, ndir);
+	memcpy(request + n + ndir, path, length);
+	if (!send_all(fileno(daemon->out), request, n + ndir + length))
+		return -1;
+
+	if (fscanf(daemon->in, "%zu %zu %zu", &count, &nroot, &nfile) != 3 || fgetc(daemon->in) != '\n' ||
+			!read_string(daemon->in, root, nroot) || !read_string(daemon->in, file, nfile))
+		return -1;
+
+	return count;
+}
+
+// The indexes read so far, replacing the one used longest ago once full.
+// Git replaces the index file whenever it changes, so it’s read again
+// when the file is a new one.
+static struct {
+	struct cached {
+		dev_t dev;
+		ino_t ino;
+		off_t size;
+		time_t mtime;
+		gitindex_t index;
+		unsigned long used;
+	} indexes[DAEMON_INDEXES];
+	size_t count;
+	unsigned long clock;
+	pthread_mutex_t lock;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// The index at path, read if need be.  The cache must be locked.
+static gitindex_t*
+cached_index (const char* path)
+{
+	struct cached* cached = NULL;
+	struct stat st;
+	size_t i;
+
+	if (stat(path, &st) < 0)
+		return NULL;
+
+	for (i = 0; i < cache.count && !cached; ++i)
+		if (cache.indexes[i].dev == st.st_dev && cache.indexes[i].ino == st.st_ino)
+			cached = &cache.indexes[i];
+
+	if (cached && cached->size == st.st_size && cached->mtime == st.st_mtime) {
+		cached->used = ++cache.clock;
+		return &cached->index;
+	}
+
+	if (!cached && cache.count < DAEMON_INDEXES) {
+		cached = &cache.indexes[cache.count++];
+	} else if (!cached) {
+		cached = &cache.indexes[0];
+		for (i = 1; i < cache.count; ++i)
+			if (cache.indexes[i].used < cached->used)
+				cached = &cache.indexes[i];
+	}
+
+	gitindex_free(&cached->index);
+	cached->dev = st.st_dev;
+	cached->ino = st.st_ino;
+	cached->size = st.st_size;
+	cached->mtime = st.st_mtime;
+	cached->used = ++cache.clock;
+
+	// A slot which couldn’t be read matches nothing until it’s tried again
+	if (!gitindex_read(&cached->index, path)) {
+		cached->ino = 0;
+		cached->size = -1;
+		return NULL;
+	}
+	return &cached->index;
+}
+
+// Answers one request, returning 0 once the client’s gone
+static int
+answer (daemon_t* client)
+{
+	char dir[PATH_MAX], path[PATH_MAX], root[PATH_MAX], index_path[PATH_MAX], file[PATH_MAX] = "";
+	const char* relative = ".";
+	const char* found;
+	gitindex_t* index;
+	size_t ndir, npath, count = 0;
+
+	if (fscanf(client->in, "%zu %zu", &ndir, &npath) != 2 || fgetc(client->in) != '\n' ||
+			!read_string(client->in, dir, ndir) || !read_string(client->in, path, npath))
+		return 0;
+
+	if (gitindex_locate(dir, root, index_path)) {
+		// The root is found by going up from dir, so what follows dir in
+		// it is the way back: "/../.." becomes "../.."
+		if (root[ndir] == '/')
+			relative = root + ndir + 1;
+
+		// Copied, since another client may have the index replaced
+		pthread_mutex_lock(&cache.lock);
+		if ((index = cached_index(index_path)) && (count = gitindex_find(index, path, npath, &found)))
+			snprintf(file, sizeof(file), "%s", found);
+		pthread_mutex_unlock(&cache.lock);
+	}
+
+	fprintf(client->out, "%zu %zu %zu\n%s%s", count, strlen(relative), strlen(file), relative, file);
+	return fflush(client->out) == 0;
+}
+
+static void*
+serve_client (void* data)
+{
+	daemon_t* client = data;
+
+	while (answer(client))
+		;
+
+	daemon_close(client);
+	free(client);
+	return NULL;
+}
+
+int
+daemon_serve (const char* path)
+{
+	struct sockaddr_un sa;
+	pthread_attr_t attr;
+	pthread_t thread;
+	daemon_t* client;
+	int fd, conn;
+
+	if (!address(&sa, path)) {
+		fprintf(stderr, "\033[1mError\033[0m: socket path too long: %s\n", path);
+		return 0;
+	}
+
+	// A socket left behind by a daemon which has gone is replaced
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 && connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0) {
+		if (trusted(fd, path))
+			fprintf(stderr, "\033[1mError\033[0m: already running on %s\n", path);
+		else
+			fprintf(stderr, "\033[1mError\033[0m: another user is listening on %s\n", path);
+		close(fd);
+		return 0;
+	}
+	if (fd >= 0)
+		close(fd);
+	unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return 0;
+	}
+
+	// Only for this user, which is settled before anyone can connect
+	if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || chmod(path, 0600) < 0 || listen(fd, 16) < 0) {
+		perror(path);
+		close(fd);
+		return 0;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (;;)
+	{
+		if ((conn = accept(fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		client = malloc(sizeof(*client));
+		if (!client) {
+			perror("malloc");
+			exit(1);
+		}
+		if (!attach(client, conn)) {
+			free(client);
+			continue;
+		}
+		if (pthread_create(&thread, &attr, serve_client, client) != 0) {
+			daemon_close(client);
+			free(client);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <limits.h>
+#include <stdio.h>
+
+#define DAEMON_INDEXES 16 // repositories whose index plsd keeps
+#define DAEMON_TIMEOUT 2  // seconds to wait on plsd before doing without it
+
+// plsd stays running and keeps the git index of each repository pls is run
+// in, so that a large one is read once rather than by every run.  It
+// listens on $PLS_SOCKET, or pls.sock in $XDG_RUNTIME_DIR, or else
+// /tmp/pls-<uid>/pls.sock.  pls only talks to a plsd run by the same user.
+typedef struct {
+	FILE* in;
+	FILE* out;
+} daemon_t;
+
+// Returns 0 if the directory in /tmp is another user's, or open to them
+int daemon_socket (char path[PATH_MAX]);
+
+// Returns 0 if plsd isn’t running
+int daemon_connect (daemon_t* daemon);
+void daemon_close (daemon_t* daemon);
+
+// Looks up a partial path among the files tracked in the repository the
+// absolute directory dir is in, as gitindex_find does.  Sets root to the
+// work tree relative to dir, and file to one of the files matching.
+// Returns -1 if plsd can’t be reached, or doesn’t answer within
+// DAEMON_TIMEOUT seconds.
+long daemon_find (daemon_t* daemon, const char* dir, const char* path, size_t length,
+                  char root[PATH_MAX], char file[PATH_MAX]);
+
+// Answers requests on the socket at path until killed.
+// Returns 0 if it can’t listen there.
+int daemon_serve (const char* path);
+
+#endif
@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "decompress.h"
+
+#define DECOMPRESS_BUFFER (64 * 1024)
+
+struct decoder {
+	enum compression type;
+	int ended;          // at the end of a gzip member or zstd frame
+	z_stream z;
+#ifdef HAVE_ZSTD
+	ZSTD_DStream* zstd;
+#endif
+};
+
+// A thread decompressing from one descriptor into another
+struct pipeline {
+	int in;
+	int out;
+	struct decoder decoder;
+	char peek[DECOMPRESS_PEEK];
+	size_t npeek;
+};
+
+enum compression
+compression (const char* s, size_t n)
+{
+	const unsigned char* u = (const unsigned char*)s;
+
+	if (n >= 2 && u[0] == 0x1f && u[1] == 0x8b)
+		return COMPRESSION_GZIP;
+	if (n >= 4 && u[0] == 0x28 && u[1] == 0xb5 && u[2] == 0x2f && u[3] == 0xfd)
+		return COMPRESSION_ZSTD;
+
+	return COMPRESSION_NONE;
+}
+
+static int
+decoder_init (struct decoder* d, enum compression type)
+{
+	memset(d, 0, sizeof(*d));
+	d->type = type;
+
+	switch (type) {
+	case COMPRESSION_GZIP:
+		// Window bits of 15, plus 16 for a gzip header
+		return inflateInit2(&d->z, 15 + 16) == Z_OK;
+	case COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+		d->zstd = ZSTD_createDStream();
+		return d->zstd && !ZSTD_isError(ZSTD_initDStream(d->zstd));
+#else
+		fprintf(stderr, "\033[1mError\033[0m: pls was built without zstd support\n");
+		return 0;
+#endif
+	case COMPRESSION_NONE:
+		break;
+	}
+
+	return 0;
+}
+
+static void
+decoder_free (struct decoder* d)
+{
+	if (d->type == COMPRESSION_GZIP)
+		inflateEnd(&d->z);
+#ifdef HAVE_ZSTD
+	if (d->type == COMPRESSION_ZSTD)
+		ZSTD_freeDStream(d->zstd);
+#endif
+}
+
+// Decompresses what it can of in into out, returning the number of bytes
+// written (or -1 for corrupt data) and setting used to the bytes read
+static long
+decode (struct decoder* d, const char* in, size_t nin, size_t* used, char* out, size_t nout)
+{
+	int r;
+
+	*used = 0;
+
+	if (d->type == COMPRESSION_GZIP) {
+		d->z.next_in = (Bytef*)in;
+		d->z.avail_in = nin;
+		d->z.next_out = (Bytef*)out;
+		d->z.avail_out = nout;
+
+		r = inflate(&d->z, Z_NO_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+			return -1;
+
+		*used = nin - d->z.avail_in;
+		if (*used > 0)
+			d->ended = 0;
+
+		// Concatenated members decompress one after another
+		if (r == Z_STREAM_END) {
+			d->ended = 1;
+			inflateReset(&d->z);
+		}
+
+		return nout - d->z.avail_out;
+	}
+
+#ifdef HAVE_ZSTD
+	if (d->type == COMPRESSION_ZSTD) {
+		ZSTD_inBuffer i = { in, nin, 0 };
+		ZSTD_outBuffer o = { out, nout, 0 };
+		size_t hint = ZSTD_decompressStream(d->zstd, &o, &i);
+
+		if (ZSTD_isError(hint))
+			return -1;
+
+		*used = i.pos;
+		d->ended = hint == 0;
+		return o.pos;
+	}
+#endif
+
+	return -1;
+}
+
+static int
+write_all (int fd, const char* s, size_t n)
+{
+	ssize_t r;
+
+	while (n > 0)
+	{
+		r = write(fd, s, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return 0;
+		s += r;
+		n -= r;
+	}
+
+	return 1;
+}
+
+static void*
+decompress_thread (void* arg)
+{
+	struct pipeline* p = arg;
+	char* in = malloc(DECOMPRESS_BUFFER);
+	char* out = malloc(DECOMPRESS_BUFFER);
+	size_t nin = p->npeek, used;
+	long produced = 0;
+	ssize_t n;
+	int eof = 0;
+
+	if (!in || !out) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(in, p->peek, p->npeek);
+
+	for (;;) {
+		// Drain any output left over before waiting on more input
+		if (!eof && nin < DECOMPRESS_BUFFER && produced < DECOMPRESS_BUFFER) {
+			n = read(p->in, in + nin, DECOMPRESS_BUFFER - nin);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				eof = 1;
+			else
+				nin += n;
+		}
+
+		produced = decode(&p->decoder, in, nin, &used, out, DECOMPRESS_BUFFER);
+		if (produced < 0) {
+			fprintf(stderr, "\033[1mError\033[0m: corrupt compressed input\n");
+			break;
+		}
+
+		nin -= used;
+		memmove(in, in + used, nin);
+
+		if (!write_all(p->out, out, produced))
+			break;
+
+		if (eof && produced == 0 && used == 0) {
+			if (nin > 0 || !p->decoder.ended)
+				fprintf(stderr, "Warning: compressed input ends early\n");
+			break;
+		}
+	}
+
+	close(p->out);
+	decoder_free(&p->decoder);
+	free(in);
+	free(out);
+	free(p);
+
+	return NULL;
+}
+
+int
+decompress_fd (int fd, char* peek, size_t* npeek)
+{
+	struct pipeline* p;
+	enum compression type;
+	pthread_t thread;
+	int pipes[2];
+	ssize_t n;
+
+	for (*npeek = 0; *npeek < DECOMPRESS_PEEK; *npeek += n)
+	{
+		n = read(fd, peek + *npeek, DECOMPRESS_PEEK - *npeek);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			break;
+	}
+
+	if ((type = compression(peek, *npeek)) == COMPRESSION_NONE)
+		return fd;
+
+	p = malloc(sizeof(*p));
+	if (!p) {
+		perror("malloc");
+		exit(1);
+	}
+	if (!decoder_init(&p->decoder, type))
+		exit(1);
+
+	if (pipe(pipes) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+
+	p->in = fd;
+	p->out = pipes[1];
+	memcpy(p->peek, peek, *npeek);
+	p->npeek = *npeek;
+	*npeek = 0;
+
+	if ((errno = pthread_create(&thread, NULL, decompress_thread, p)) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	pthread_detach(thread);
+
+	return pipes[0];
+}
+
+int
+decompress_buffer (const char* s, size_t n, char** out, size_t* nout)
+{
+	struct decoder d;
+	size_t size = n*4 + DECOMPRESS_BUFFER, used;
+	long produced;
+	int ok = 1;
+
+	*nout = 0;
+	*out = NULL;
+
+	if (!decoder_init(&d, compression(s, n)))
+		return 0;
+
+	for (;;) {
+		if (size - *nout < DECOMPRESS_BUFFER || !*out) {
+			if (*out)
+				size *= 2;
+			*out = realloc(*out, size);
+			if (!*out) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+
+		produced = decode(&d, s, n, &used, *out + *nout, size - *nout - 1);
+		if (produced < 0) {
+			ok = 0;
+			break;
+		}
+
+		s += used;
+		n -= used;
+		*nout += produced;
+
+		if (produced == 0 && used == 0) {
+			ok = n == 0 && d.ended;
+			break;
+		}
+	}
+
+	(*out)[*nout] = '\0';
+	decoder_free(&d);
+
+	return ok;
+}
@@ -0,0 +1,26 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+
+enum compression {
+	COMPRESSION_NONE,
+	COMPRESSION_GZIP,
+	COMPRESSION_ZSTD, // only read when built with HAVE_ZSTD
+};
+
+// Recognises compressed data by its magic bytes
+enum compression compression (const char* s, size_t n);
+
+// Reads the start of fd, and if it’s compressed starts a thread
+// decompressing it into a pipe, returning the pipe to read instead.
+// Otherwise fd is returned, and the npeek bytes read from it into peek
+// (up to DECOMPRESS_PEEK) come before the rest.
+#define DECOMPRESS_PEEK 4
+int decompress_fd (int fd, char* peek, size_t* npeek);
+
+// Decompresses all of s into a new buffer, followed by a NUL.
+// Returns 0 if the data is corrupt.
+int decompress_buffer (const char* s, size_t n, char** out, size_t* nout);
+
+#endif
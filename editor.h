@@ -14,7 +14,7 @@ is_named_executable (const char* cmd, const char* name)
 	char buf[BUFSIZ];
 	char* base, *end;
 
-	strcpy(buf, cmd);
+	snprintf(buf, sizeof(buf), "%s", cmd);
 
 	base = basename(buf);
 	end = strchr(base, ' ');
@@ -25,10 +25,23 @@ is_named_executable (const char* cmd, const char* name)
 	return 0 == strncmp(base, name, n);
 }
 
+// Sets cmd to the editor followed by its arguments, or returns NULL if
+// they don’t fit
+char*
+editor_join (char cmd[BUFSIZ], const char* env, const char* args)
+{
+	if (strlen(env) + strlen(args) >= BUFSIZ)
+		return NULL;
+	strcpy(cmd, env);
+	strcat(cmd, args);
+	return cmd;
+}
+
 // If the PLS variable is set, we format into that
 // Otherwise, if EDITOR is set, we try to determine how to use it
 // If neither is set we fall back on the default EDITOR_COMMAND.
-// This function returns a string using internal static storage.
+// This function returns a string using internal static storage, or NULL
+// if the command is too long.
 char*
 editor_command ()
 {
@@ -42,42 +55,30 @@ editor_command ()
 		// so it might be best to just take the executable path only for those cases.
 		if(is_named_executable(env, "mate") || is_named_executable(env, "mate_wait"))
 		{
-			strcpy(cmd, env);
-			strcat(cmd, " --line %d:%d");
-			return cmd;
+			return editor_join(cmd, env, " --line %d:%d");
 		}
 		else if (is_named_executable(env, "subl") || is_named_executable(env, "atom"))
 		{
-			strcpy(cmd, env);
-			strcat(cmd, " %s:%d:%d");
-			return cmd;
+			return editor_join(cmd, env, " %s:%d:%d");
 		}
 		else if(is_named_executable(env, "vim") || is_named_executable(env, "vi"))
 		{
-			strcpy(cmd, env);
-			strcat(cmd, " +'call cursor(%d, %d)'");
-			return cmd;
+			return editor_join(cmd, env, " +'call cursor(%d, %d)'");
 		}
 		else if(is_named_executable(env, "phpstorm") || is_named_executable(env, "idea"))
 		{
-			strcpy(cmd, env);
-			strcat(cmd, " --line %d \"$PWD/%s\"");
-			return cmd;
+			return editor_join(cmd, env, " --line %d \"$PWD/%s\"");
 		}
 		else if(is_named_executable(env, "emacs") || is_named_executable(env, "emacsclient"))
 		{
-			strcpy(cmd, env);
-			strcat(cmd, " +%d:%d");
-			return cmd;
+			return editor_join(cmd, env, " +%d:%d");
 		}
 	}
 
 	if(!env)
 		env = EDITOR_COMMAND;
 
-	strcpy(cmd, env ? env : EDITOR_COMMAND);
-
-	return cmd;
+	return editor_join(cmd, env, "");
 }
 
 #endif
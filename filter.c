@@ -0,0 +1,211 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+
+// memchr() is vectorised by the C library, so we let it skip to candidate
+// first characters and only compare the rest of the query there.
+const char*
+find_substring (const char* s, const char* end, const char* query, size_t length)
+{
+	if (length == 0)
+		return s;
+
+	while (s + length <= end)
+	{
+		s = memchr(s, query[0], end - s - length + 1);
+		if (!s)
+			return NULL;
+		if (0 == memcmp(s + 1, query + 1, length - 1))
+			return s;
+		++s;
+	}
+
+	return NULL;
+}
+
+int
+is_subsequence (const char* s, const char* end, const char* query, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; ++i)
+	{
+		s = memchr(s, query[i], end - s);
+		if (!s)
+			return 0;
+		++s;
+	}
+
+	return 1;
+}
+
+void
+filter_init (filter_t* filter)
+{
+	memset(filter, 0, sizeof(*filter));
+}
+
+void
+filter_free (filter_t* filter)
+{
+	free(filter->arena);
+	free(filter->keys);
+	free(filter->results);
+	memset(filter, 0, sizeof(*filter));
+}
+
+void
+filter_reset (filter_t* filter)
+{
+	size_t i;
+
+	for (i = 0; i < filter->count; ++i)
+		filter->results[i] = i;
+
+	filter->nresults = filter->count;
+	filter->query_length = 0;
+}
+
+// Forgets the last query, so the next update scans every key again
+// rather than narrowing results that may no longer hold
+void
+filter_invalidate (filter_t* filter)
+{
+	filter->query_length = 0;
+}
+
+// Index of the key containing the arena offset
+static size_t
+key_index (filter_t* filter, size_t offset)
+{
+	size_t lo = 0, hi = filter->count;
+
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (filter->keys[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int
+key_matches (filter_t* filter, size_t i, const char* query, size_t length)
+{
+	const char* s   = filter->arena + filter->keys[i];
+	const char* end = filter->arena + filter->keys[i+1] - 1;
+
+	if (filter->fuzzy)
+		return is_subsequence(s, end, query, length);
+
+	return NULL != find_substring(s, end, query, length);
+}
+
+// Substring search over the whole arena at once: keys are NUL separated so a
+// hit can’t span two of them, and after a hit we skip to the next key.
+static void
+scan_all (filter_t* filter, const char* query, size_t length)
+{
+	const char* s   = filter->arena;
+	const char* end = filter->arena + filter->arena_nmemb;
+	size_t i;
+
+	filter->nresults = 0;
+
+	if (filter->fuzzy)
+	{
+		for (i = 0; i < filter->count; ++i)
+			if (key_matches(filter, i, query, length))
+				filter->results[filter->nresults++] = i;
+		return;
+	}
+
+	while ((s = find_substring(s, end, query, length)))
+	{
+		i = key_index(filter, s - filter->arena);
+		filter->results[filter->nresults++] = i;
+		s = filter->arena + filter->keys[i+1];
+	}
+}
+
+void
+filter_add (filter_t* filter, const char* s, size_t length)
+{
+	size_t i;
+
+	if (filter->key_size < filter->count + 2) {
+		filter->key_size = filter->key_size ? filter->key_size * 2 : BUFSIZ;
+		filter->keys = realloc(filter->keys, filter->key_size * sizeof(*filter->keys));
+		filter->results = realloc(filter->results, filter->key_size * sizeof(*filter->results));
+		if (!filter->keys || !filter->results) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	while (filter->arena_size < filter->arena_nmemb + length + 1) {
+		filter->arena_size = filter->arena_size ? filter->arena_size * 2 : BUFSIZ;
+		filter->arena = realloc(filter->arena, filter->arena_size);
+		if (!filter->arena) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	filter->keys[filter->count] = filter->arena_nmemb;
+	for (i = 0; i < length; ++i)
+		filter->arena[filter->arena_nmemb++] = tolower((unsigned char)s[i]);
+	filter->arena[filter->arena_nmemb++] = '\0';
+
+	++filter->count;
+	filter->keys[filter->count] = filter->arena_nmemb;
+
+	// Keys added while a query is active are tested against it straight away
+	i = filter->count-1;
+	if (filter->query_length == 0 || key_matches(filter, i, filter->query, filter->query_length))
+		filter->results[filter->nresults++] = i;
+}
+
+size_t
+filter_update (filter_t* filter, const char* query, size_t length)
+{
+	char lower[MAX_QUERY];
+	size_t i, n;
+
+	if (length >= MAX_QUERY)
+		length = MAX_QUERY - 1;
+
+	for (i = 0; i < length; ++i)
+		lower[i] = tolower((unsigned char)query[i]);
+
+	if (length == 0)
+	{
+		filter_reset(filter);
+	}
+	else if (filter->query_length > 0 && filter->query_length <= length &&
+	         filter->fuzzy == filter->results_fuzzy &&
+	         0 == memcmp(filter->query, lower, filter->query_length))
+	{
+		// Anything matching the longer query also matched the shorter one,
+		// so we only need to narrow the previous results.
+		for (i = n = 0; i < filter->nresults; ++i)
+			if (key_matches(filter, filter->results[i], lower, length))
+				filter->results[n++] = filter->results[i];
+		filter->nresults = n;
+	}
+	else
+	{
+		scan_all(filter, lower, length);
+	}
+
+	memcpy(filter->query, lower, length);
+	filter->query_length = length;
+	filter->results_fuzzy = filter->fuzzy;
+
+	return filter->nresults;
+}
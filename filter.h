@@ -0,0 +1,43 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+#define MAX_QUERY 256
+
+// An index of lowercased keys (one per field), searched as the user types.
+// Keys are stored NUL separated in a single arena so a full scan is one pass
+// over contiguous memory, and a query that extends the previous one only
+// re-tests the previous results.
+typedef struct {
+	char *arena;
+	size_t arena_nmemb;
+	size_t arena_size;
+
+	size_t *keys;        // offset of each key in the arena
+	size_t count;        // number of keys
+	size_t key_size;     // current size of the keys array
+
+	size_t *results;     // indices of keys matching the query
+	size_t nresults;
+
+	char query[MAX_QUERY];
+	size_t query_length;
+	int fuzzy;           // subsequence instead of substring matching
+	int results_fuzzy;   // mode the current results were computed with
+} filter_t;
+
+void filter_init (filter_t* filter);
+void filter_free (filter_t* filter);
+
+void filter_add (filter_t* filter, const char* s, size_t length);
+
+size_t filter_update (filter_t* filter, const char* query, size_t length);
+void filter_reset (filter_t* filter);
+void filter_invalidate (filter_t* filter);
+
+// (private)
+const char* find_substring (const char* s, const char* end, const char* query, size_t length);
+int is_subsequence (const char* s, const char* end, const char* query, size_t length);
+
+#endif
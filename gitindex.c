@@ -0,0 +1,391 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gitindex.h"
+
+#define MAX_DEPTH 64 // directories to look up through for a repository
+
+static uint32_t
+be32 (const unsigned char* u)
+{
+	return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+static void*
+grow (void* v, size_t* size, size_t count, size_t width)
+{
+	if (count < *size)
+		return v;
+
+	while (*size <= count)
+		*size = *size ? *size*2 : 64;
+	v = realloc(v, *size*width);
+	if (!v) {
+		perror("realloc");
+		exit(1);
+	}
+	return v;
+}
+
+static uint32_t
+hash (uint32_t parent, const char* s, size_t n)
+{
+	uint32_t h = 2166136261u ^ (parent * 2654435761u);
+
+	while (n-- > 0)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+
+	return h;
+}
+
+// The node for a component under parent, or the empty slot it would take
+static uint32_t*
+slot (const gitindex_t* index, uint32_t parent, const char* s, size_t n, uint32_t h)
+{
+	size_t mask = index->table_size - 1, i;
+	const struct gitindex_node* node;
+
+	for (i = h & mask; index->table[i]; i = (i + 1) & mask)
+	{
+		node = &index->nodes[index->table[i]];
+		if (node->hash == h && node->parent == parent && node->length == n &&
+				memcmp(index->names + node->name, s, n) == 0)
+			break;
+	}
+
+	return &index->table[i];
+}
+
+static void
+rehash (gitindex_t* index)
+{
+	size_t i;
+
+	free(index->table);
+	index->table_size = index->table_size ? index->table_size*2 : 1024;
+	index->table = calloc(index->table_size, sizeof(*index->table));
+	if (!index->table) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 1; i < index->nnodes; ++i)
+	{
+		const struct gitindex_node* node = &index->nodes[i];
+		*slot(index, node->parent, index->names + node->name, node->length, node->hash) = i;
+	}
+}
+
+// Counts a file under each suffix of its path
+static void
+add_file (gitindex_t* index, uint32_t file, size_t length)
+{
+	const char* path = index->names + file;
+	size_t stop = length, start;
+	uint32_t parent = 0, h, *s;
+	struct gitindex_node* node;
+
+	while (stop > 0)
+	{
+		for (start = stop; start > 0 && path[start-1] != '/'; --start)
+			;
+
+		h = hash(parent, path + start, stop - start);
+		s = slot(index, parent, path + start, stop - start, h);
+		if (!*s) {
+			index->nodes = grow(index->nodes, &index->node_size, index->nnodes, sizeof(*index->nodes));
+			node = &index->nodes[index->nnodes];
+			node->parent = parent;
+			node->name = file + start;
+			node->length = stop - start;
+			node->hash = h;
+			node->count = 0;
+			*s = index->nnodes++;
+
+			if (index->nnodes*2 > index->table_size) {
+				rehash(index);
+				s = slot(index, parent, path + start, stop - start, h);
+			}
+		}
+
+		node = &index->nodes[*s];
+		node->count++;
+		node->file = file;
+		parent = *s;
+
+		stop = start > 0 ? start - 1 : 0;
+	}
+}
+
+// The offset encoding of version 4 entries
+static int
+varint (const unsigned char* u, size_t n, size_t* p, size_t* value)
+{
+	unsigned char c;
+
+	if (*p >= n)
+		return 0;
+	c = u[(*p)++];
+	*value = c & 127;
+
+	while (c & 128)
+	{
+		if (*p >= n)
+			return 0;
+		c = u[(*p)++];
+		*value = ((*value + 1) << 7) + (c & 127);
+	}
+
+	return 1;
+}
+
+int
+gitindex_parse (gitindex_t* index, const char* s, size_t n, size_t hash_size)
+{
+	const unsigned char* u = (const unsigned char*)s;
+	uint32_t version, count, i, mode, flags;
+	size_t p = 12, q, strip, length, previous = 0, last = 0, size = 0;
+	const char* nul;
+	char* path = NULL;  // of the previous entry, which version 4 builds on
+
+	memset(index, 0, sizeof(*index));
+	index->nnodes = 1; // the root
+
+	if (n < 12 || memcmp(s, "DIRC", 4) != 0)
+		return 0;
+	version = be32(u + 4);
+	count = be32(u + 8);
+	if (version < 2 || version > 4)
+		return 0;
+
+	for (i = 0; i < count; ++i)
+	{
+		q = p + 40 + hash_size + 2;
+		if (q > n)
+			goto corrupt;
+		mode = be32(u + p + 24);
+		flags = u[q-2] << 8 | u[q-1];
+
+		// Extended flags
+		if (flags & 0x4000) {
+			if (version < 3)
+				goto corrupt;
+			q += 2;
+		}
+
+		// Names before version 4 are whole
+		strip = previous;
+		if (version == 4 && (!varint(u, n, &q, &strip) || strip > previous))
+			goto corrupt;
+		if (q >= n || !(nul = memchr(s + q, '\0', n - q)))
+			goto corrupt;
+		length = nul - (s + q);
+
+		path = grow(path, &size, previous - strip + length + 1, 1);
+		memcpy(path + previous - strip, s + q, length + 1);
+		length += previous - strip;
+
+		// The length is given too, unless it’s too long to fit
+		if ((flags & 0xfff) != (length < 0xfff ? length : 0xfff))
+			goto corrupt;
+
+		// Entries of version 4 aren’t padded, the others are to 8 bytes
+		if (version == 4)
+			p = nul - s + 1;
+		else
+			p += (q - p + nul - (s + q) + 8) & ~(size_t)7;
+
+		// Only files and links, once each for entries in conflict
+		if ((mode & 0170000) == 0100000 || (mode & 0170000) == 0120000) {
+			if (index->names_length == 0 || last != length ||
+					memcmp(index->names + index->names_length - length - 1, path, length) != 0) {
+				index->names = grow(index->names, &index->names_size, index->names_length + length + 1, 1);
+				memcpy(index->names + index->names_length, path, length + 1);
+				index->names_length += length + 1;
+				last = length;
+			}
+		}
+		previous = length;
+	}
+
+	rehash(index);
+	for (q = 0; q < index->names_length; q += length + 1)
+	{
+		length = strlen(index->names + q);
+		add_file(index, q, length);
+	}
+
+	free(path);
+	return 1;
+
+corrupt:
+	free(path);
+	gitindex_free(index);
+	return 0;
+}
+
+size_t
+gitindex_find (const gitindex_t* index, const char* path, size_t length, const char** file)
+{
+	size_t stop = length, start;
+	uint32_t node = 0, *s;
+
+	if (!index->table || length == 0 || path[0] == '/')
+		return 0;
+
+	while (stop > 0)
+	{
+		for (start = stop; start > 0 && path[start-1] != '/'; --start)
+			;
+
+		// Paths back up the tree can’t be found from the end
+		if (stop - start == 2 && path[start] == '.' && path[start+1] == '.')
+			return 0;
+
+		if (stop > start && !(stop - start == 1 && path[start] == '.')) {
+			s = slot(index, node, path + start, stop - start, hash(node, path + start, stop - start));
+			if (!*s)
+				return 0;
+			node = *s;
+		}
+
+		stop = start > 0 ? start - 1 : 0;
+	}
+
+	if (node == 0)
+		return 0;
+
+	*file = index->names + index->nodes[node].file;
+	return index->nodes[node].count;
+}
+
+// Writes dir/name to out, returning 0 if it’s too long
+static int
+join (char out[PATH_MAX], const char* dir, const char* name)
+{
+	int n = snprintf(out, PATH_MAX, "%s/%s", dir, name);
+
+	return n >= 0 && n < PATH_MAX;
+}
+
+// Reads a .git file, as in a worktree or submodule, for the directory it
+// points to
+static int
+gitdir_file (const char* git, const char* root, char dir[PATH_MAX])
+{
+	char line[PATH_MAX + 16];
+	FILE* f = fopen(git, "r");
+	size_t n;
+
+	if (!f)
+		return 0;
+	n = fgets(line, sizeof(line), f) ? strlen(line) : 0;
+	fclose(f);
+
+	while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+		line[--n] = '\0';
+	if (strncmp(line, "gitdir: ", 8) != 0 || n - 8 >= PATH_MAX)
+		return 0;
+
+	if (line[8] == '/') {
+		memcpy(dir, line + 8, n - 7);
+		return 1;
+	}
+	return join(dir, root, line + 8);
+}
+
+int
+gitindex_locate (const char* dir, char root[PATH_MAX], char path[PATH_MAX])
+{
+	char git[PATH_MAX];
+	struct stat st, up;
+	int depth;
+
+	if (strlen(dir) >= PATH_MAX)
+		return 0;
+	strcpy(root, dir);
+
+	for (depth = 0; ; ++depth)
+	{
+		if (!join(git, root, ".git"))
+			return 0;
+		if (stat(git, &st) == 0)
+			break;
+
+		// Stop at the top of the file system
+		if (depth == MAX_DEPTH || stat(root, &st) < 0)
+			return 0;
+		if (strcmp(root, ".") == 0)
+			strcpy(path, "..");
+		else if (!join(path, root, ".."))
+			return 0;
+		if (stat(path, &up) < 0 || (up.st_dev == st.st_dev && up.st_ino == st.st_ino))
+			return 0;
+		strcpy(root, path);
+	}
+
+	if (!S_ISDIR(st.st_mode) && !gitdir_file(git, root, git))
+		return 0;
+	return join(path, git, "index");
+}
+
+int
+gitindex_read (gitindex_t* index, const char* path)
+{
+	struct stat st;
+	void* map;
+	int fd, ok;
+
+	memset(index, 0, sizeof(*index));
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+			(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	// Object names are SHA-1, or SHA-256 in newer repositories; only the
+	// right size gives entries whose name lengths agree
+	ok = gitindex_parse(index, map, st.st_size, 20) ||
+	     gitindex_parse(index, map, st.st_size, 32);
+	munmap(map, st.st_size);
+
+	return ok;
+}
+
+int
+gitindex_load (gitindex_t* index, const char* dir)
+{
+	char root[PATH_MAX], path[PATH_MAX];
+
+	memset(index, 0, sizeof(*index));
+	if (!gitindex_locate(dir, root, path) || !gitindex_read(index, path))
+		return 0;
+
+	index->root = malloc(strlen(root) + 1);
+	if (!index->root) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(index->root, root);
+
+	return 1;
+}
+
+void
+gitindex_free (gitindex_t* index)
+{
+	free(index->root);
+	free(index->names);
+	free(index->nodes);
+	free(index->table);
+	memset(index, 0, sizeof(*index));
+}
@@ -0,0 +1,50 @@
+#ifndef GITINDEX_H
+#define GITINDEX_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The files tracked by a git repository, read from its index and kept in
+// a trie of path components from the last one back, so that a partial
+// path such as "test/sample.js" finds every file ending with it.
+typedef struct {
+	char* root;           // of the work tree, relative to the directory given
+	char* names;          // each tracked path, NUL terminated
+	size_t names_length;
+	size_t names_size;
+
+	struct gitindex_node {
+		uint32_t parent;  // the following component, or 0 for the root
+		uint32_t name;    // offset of the component in names
+		uint32_t length;
+		uint32_t hash;
+		uint32_t count;   // files with this suffix
+		uint32_t file;    // offset of one of them in names
+	} *nodes;
+	size_t nnodes;
+	size_t node_size;
+
+	uint32_t* table;      // node indices hashed by parent and component
+	size_t table_size;
+} gitindex_t;
+
+// Reads the index of the repository dir is in.
+// Returns 0 outside a repository or if the index can’t be read.
+int gitindex_load (gitindex_t* index, const char* dir);
+
+// The steps of gitindex_load: finding the work tree of the repository dir
+// is in, and its index file, then reading that
+int gitindex_locate (const char* dir, char root[PATH_MAX], char path[PATH_MAX]);
+int gitindex_read (gitindex_t* index, const char* path);
+void gitindex_free (gitindex_t* index);
+
+// Parses the contents of an index file (versions 2 to 4), with hashes of
+// hash_size bytes.  Returns 0 if it’s corrupt.
+int gitindex_parse (gitindex_t* index, const char* s, size_t n, size_t hash_size);
+
+// Returns the number of tracked files whose path ends with the components
+// of path, and sets file to the path of one of them.
+size_t gitindex_find (const gitindex_t* index, const char* path, size_t length, const char** file);
+
+#endif
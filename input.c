@@ -1,59 +1,199 @@
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include "input.h"
+#include "ansi.h"
+#include "width.h"
 
-// ESC \d+ [;\d+ [; ...]] m
+// Any escape sequence: CSI, OSC, charset selection, etc.
 char*
 consume_escape_seq (char* c)
 {
-	if(*c != '\033' || c[1] != '[')
-		return c;
-
-	++c;
-
-	do
-	{
-		++c;
-
-		while(isdigit(*c))
-			++c;
-	}
-	while(*c == ';');
-
-	++c;
-
-	return c;
+	return (char*)ansi_skip(c);
 }
 
+// Returns the start of the display line following line_start,
+// or NULL if the line doesn’t end before end.
 char*
-find_next_line (char* line_start, int width)
+find_next_line (char* line_start, char* end, int width)
 {
 	int display_width = 0;
 	char* c = line_start;
+	unsigned long cp;
+	int n, w;
 
-	while(*c != '\0' && display_width < width)
+	while(c < end && display_width < width)
 	{
+		n = ascii_span(c, end, width - display_width);
+		c += n;
+		display_width += n;
+
+		if(c == end || display_width == width)
+			break;
+
 		if(*c == '\n')
 			return c+1;
 
 		if(*c == '\033')
 		{
-			c = consume_escape_seq(c);
+			char* next = consume_escape_seq(c);
+			if(next > end) // wait for the rest of the sequence
+				return NULL;
+			c = next == c ? c+1 : next;
 		}
-		else
+		else if(*c == '\t')
 		{
+			display_width += TAB_WIDTH - display_width % TAB_WIDTH;
+			if(display_width > width)
+				display_width = width;
 			++c;
-			++display_width;
 		}
+		else
+		{
+			n = utf8_decode(c, end, &cp);
+			if(n == 0) // wait for the rest of the sequence
+				return NULL;
+
+			w = codepoint_width(cp);
+			if(display_width + w > width && c > line_start)
+				return c; // a wide character that doesn’t fit wraps early
+
+			c += n;
+			display_width += w;
+		}
+	}
+
+	// The terminal doesn’t wrap until the next character is printed,
+	// so a newline straight after a full line doesn’t add another.
+	while(c < end && *c == '\033' && consume_escape_seq(c) != c)
+		c = consume_escape_seq(c);
+
+	if(c >= end)
+		return NULL;
+
+	if(*c == '\n')
+		return c+1;
+
+	return c;
+}
+
+// Records the start of each line in the newly read bytes, and the time
+// they were read as when the lines before ended
+static void
+index_lines (input_t* input, size_t start, size_t stop)
+{
+	const char* c = input->v + start;
+	const char* end = input->v + stop;
+	struct timespec now;
+	size_t ms = 0;
+
+	if(input->timed) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (now.tv_sec - input->started.tv_sec)*1000 + (now.tv_nsec - input->started.tv_nsec)/1000000;
+	}
+
+	while((c = memchr(c, '\n', end - c)))
+	{
+		++c;
+		++input->nlines;
+		seq_push(&input->line_offsets, c - input->v);
+		if(input->timed)
+			seq_push(&input->line_times, ms);
+	}
+}
+
+// Moves the output into a temporary file, deleted straight away so that
+// it’s gone when pls exits, and maps it in place of the heap buffer
+static int
+spill (input_t* input, size_t size)
+{
+	const char* dir = getenv("TMPDIR");
+	char path[PATH_MAX];
+	static int count = 0;
+	char* v;
+	int fd;
+
+	if (!dir || !*dir)
+		dir = "/tmp";
+
+	do {
+		snprintf(path, sizeof(path), "%s/pls-%ld-%d.out", dir, (long)getpid(), count++);
+		fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	} while (fd < 0 && errno == EEXIST);
+
+	if (fd < 0) {
+		perror(path);
+		return 0;
+	}
+	unlink(path);
+
+	// The blocks are taken up front: a mapping past what the disk has room
+	// for would only fail with SIGBUS when written
+	if ((errno = posix_fallocate(fd, 0, size)) != 0 ||
+			(v = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror(path);
+		close(fd);
+		return 0;
+	}
+
+	memcpy(v, input->v, input->nmemb + 1);
+	free(input->v);
+
+	input->v = v;
+	input->spill = fd;
+	input->size = size;
+
+	return 1;
+}
+
+// Keeps the output on the heap, sized for size bytes
+static int
+realloc_to (input_t* input, size_t size)
+{
+	char* v = realloc(input->v, size);
+
+	if (!v)
+		return 0;
+	input->v = v;
+	input->size = size;
+	return 1;
+}
+
+// Makes room for at least size bytes.  Returns 0 if neither memory nor
+// disk can be found, leaving the input as it was.
+static int
+grow (input_t* input, size_t size)
+{
+	size_t n = input->size;
+	char* v;
+
+	while (n < size)
+		n *= 2;
+
+	if (input->spill < 0 && n <= input->spill_at && realloc_to(input, n))
+		return 1;
+
+	// Without room on disk, memory may still do
+	if (input->spill < 0)
+		return spill(input, n) || realloc_to(input, n);
+
+	// The file’s already mapped, so a second mapping sees the same bytes
+	if ((errno = posix_fallocate(input->spill, input->size, n - input->size)) != 0 ||
+			(v = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED, input->spill, 0)) == MAP_FAILED) {
+		perror("output file");
+		return 0;
 	}
+	munmap(input->v, input->size);
 
-	if(display_width == width)
-		return line_start+width;
+	input->v = v;
+	input->size = n;
 
-	return NULL;
+	return 1;
 }
 
 size_t
-input_read (input_t* input, int fd, int width, int echo)
+input_read (input_t* input, int fd)
 {
 	if (input->size == 0) {
 		fprintf(stderr, "ERROR: read before init\n");
@@ -61,6 +201,8 @@ input_read (input_t* input, int fd, int width, int echo)
 	}
 
 	int n = read(fd, input->v + input->nmemb, input->size - input->nmemb-1);
+	if (n < 0 && errno == EINTR)
+		return 1;
 	if (n < 0) {
 		perror("read");
 		return 0;
@@ -71,66 +213,239 @@ input_read (input_t* input, int fd, int width, int echo)
 
 	input->v[input->nmemb + n] = '\0';
 
-	if(echo)
-		printf("%s", input->v + input->nmemb);
+	index_lines(input, input->nmemb, input->nmemb + n);
+
+	input->nmemb += n;
+
+	// What’s been read so far is kept, but no more
+	if (input->size < input->nmemb + BUFSIZ && !grow(input, input->nmemb + BUFSIZ)) {
+		fprintf(stderr, "Warning: output cut short at %zu bytes\n", input->nmemb);
+		return 0;
+	}
+	return 1;
+}
+
+void
+input_append (input_t* input, const char* s, size_t n)
+{
+	if (input->size < input->nmemb + n + 1 && !grow(input, input->nmemb + n + 1)) {
+		fprintf(stderr, "Warning: output cut short at %zu bytes\n", input->nmemb);
+		return;
+	}
+
+	memcpy(input->v + input->nmemb, s, n);
+	input->v[input->nmemb + n] = '\0';
+
+	index_lines(input, input->nmemb, input->nmemb + n);
 
-	char* line_start = input->v + input->line_offsets[input->nlines];
+	input->nmemb += n;
+}
 
-	while((line_start = find_next_line(line_start, width)))
+size_t
+input_line_offset (input_t* input, size_t index)
+{
+	return seq_get(&input->line_offsets, index);
+}
+
+long
+input_line_time (input_t* input, size_t index)
+{
+	if(index >= input->line_times.count)
+		return -1;
+	return seq_get(&input->line_times, index);
+}
+
+size_t
+find_line_index (input_t* input, size_t offset)
+{
+	return seq_find(&input->line_offsets, offset);
+}
+
+// Start of the nth display row from c, a row start
+static char*
+nth_row_from (input_t* input, char* c, int width, size_t n)
+{
+	char* end = input->v + input->nmemb;
+	char* next;
+
+	while(n-- > 0 && (next = find_next_line(c, end, width)))
+		c = next;
+
+	return c;
+}
+
+// Start of the nth display row of a line
+static char*
+nth_row (input_t* input, size_t index, int width, size_t n)
+{
+	return nth_row_from(input, input->v + input_line_offset(input, index), width, n);
+}
+
+// Display rows from c, a row start, to the end of its line
+static size_t
+rows_from (input_t* input, char* c, size_t index, int width)
+{
+	char* end = input->v + input->nmemb;
+	char* line_end = index < input->nlines ? input->v + input_line_offset(input, index+1) : end;
+	size_t rows = 0;
+
+	while(c < line_end)
 	{
-		++input->nlines;
+		++rows;
+		if(!(c = find_next_line(c, end, width)))
+			break;
+	}
+
+	return rows;
+}
+
+size_t
+input_rows (input_t* input, size_t index, int width)
+{
+	return rows_from(input, input->v + input_line_offset(input, index), index, width);
+}
+
+// Fills rows with the starts of up to height display rows from c
+static size_t
+fill_rows (input_t* input, char* c, int width, size_t height, size_t* rows)
+{
+	char* end = input->v + input->nmemb;
+	size_t count = 0;
+
+	while(count < height && c < end)
+	{
+		rows[count++] = c - input->v;
+		if(!(c = find_next_line(c, end, width)))
+			c = end;
+	}
+	rows[count] = c - input->v;
+
+	return count;
+}
 
-		input->line_offsets[input->nlines] = line_start - input->v;
+// Display rows are only worked out for the lines around offset, so the
+// index stays valid whatever the width of the terminal.
+size_t
+input_layout (input_t* input, size_t offset, int width, size_t height, size_t* rows)
+{
+	size_t index = find_line_index(input, offset);
+	char* end = input->v + input->nmemb;
+	char* c = input->v + input_line_offset(input, index);
+	char* next;
+	size_t above = 0, want = height/2, n;
 
-		if (input->line_offset_size < input->nlines + BUFSIZ) {
-			input->line_offset_size += BUFSIZ;
-			input->line_offsets = realloc(input->line_offsets, input->line_offset_size*sizeof(*input->line_offsets));
+	// Rows of the line before the one containing offset
+	while((next = find_next_line(c, end, width)) && next <= input->v + offset && next < end)
+	{
+		c = next;
+		++above;
+	}
+
+	if(above >= want)
+	{
+		c = nth_row(input, index, width, above - want);
+	}
+	else
+	{
+		want -= above;
+		c = input->v + input_line_offset(input, index);
+
+		while(index > 0 && want > 0)
+		{
+			n = input_rows(input, --index, width);
+			if(n >= want) {
+				c = nth_row(input, index, width, n - want);
+				want = 0;
+			} else {
+				c = input->v + input_line_offset(input, index);
+				want -= n;
+			}
 		}
 	}
 
-	input->nmemb += n;
+	return fill_rows(input, c, width, height, rows);
+}
+
+size_t
+input_rows_back (input_t* input, int width, size_t max)
+{
+	size_t rows = 0, index = input->nlines + 1;
+
+	while(index > 0 && rows <= max)
+		rows += input_rows(input, --index, width);
+
+	// The cursor is still on an unterminated last line
+	if(rows > 0 && input->v[input->nmemb-1] != '\n')
+		--rows;
+
+	return rows < max ? rows : max;
+}
+
+size_t
+input_tail (input_t* input, int width, size_t max)
+{
+	size_t rows = 0, n, index = input->nlines + 1;
 
-	if (input->size < input->nmemb + BUFSIZ) {
-		input->size *= 2;
-		input->v = realloc(input->v, input->size);
-		if (!input->v)
-			perror("realloc");
+	while(index > 0)
+	{
+		n = input_rows(input, --index, width);
+		if(rows + n >= max)
+			return nth_row(input, index, width, rows + n - max) - input->v;
+		rows += n;
 	}
-	return 1;
+
+	return 0;
 }
 
 size_t
-find_line_index (input_t* input, size_t offset)
+input_tail_mark (input_t* input, int width, size_t max, input_mark_t* mark, size_t* rows)
 {
-	size_t i;
-	for (i = 0; i < input->nlines; ++i)
+	size_t index = input->nlines + 1, n;
+	char* c;
+
+	*rows = 0;
+	while(index > 0)
 	{
-		if(input->line_offsets[i] == offset)
-			return i;
-		if(i == input->nlines-1)
-			return i;
-		if(input->line_offsets[i] < offset && offset < input->line_offsets[i+1])
-			return i;
+		c = input->v + input_line_offset(input, --index);
+
+		// Rows before the mark are only wrapped if they're needed
+		if(mark->width == width && mark->line == index && input->v + mark->offset > c &&
+				*rows + (n = rows_from(input, input->v + mark->offset, index, width)) >= max)
+			c = input->v + mark->offset;
+		else
+			n = rows_from(input, c, index, width);
+
+		if(*rows + n >= max) {
+			c = nth_row_from(input, c, width, *rows + n - max);
+			mark->line = index;
+			mark->offset = c - input->v;
+			mark->width = width;
+			*rows = max;
+			return c - input->v;
+		}
+		*rows += n;
 	}
-	fprintf(stderr, "ERROR: Couldn't find line index: %zu\n", offset);
-	exit(1);
+
+	return 0;
 }
 
 size_t
-find_end_offset (input_t* input, size_t stop_offset, size_t height)
+input_layout_tail (input_t* input, int width, size_t height, size_t* rows)
 {
-	size_t index = find_line_index(input, stop_offset);
+	size_t n = input_rows_back(input, width, height);
 
-	index += height;
-	if(index >= input->nlines)
-		index = input->nlines-1;
+	// Counting an unterminated last line, which the cursor isn’t below
+	if (n < height && input->nmemb > 0 && input->v[input->nmemb-1] != '\n')
+		++n;
 
-	return input->line_offsets[index];
+	return fill_rows(input, input->v + input_tail(input, width, n), width, height, rows);
 }
 
 void
 input_init (input_t* input)
 {
+	const char* env;
+
 	input->size = BUFSIZ;
 	input->nmemb = 0;
 	input->v = malloc(input->size);
@@ -139,17 +454,47 @@ input_init (input_t* input)
 		exit(1);
 	}
 
+	// PLS_SPILL gives the threshold in megabytes
+	input->spill_at = INPUT_SPILL;
+	if ((env = getenv("PLS_SPILL")) && *env)
+		input->spill_at = strtoul(env, NULL, 10) << 20;
+	input->spill = -1;
+
+	input->nlines = 0;
+	seq_init(&input->line_offsets);
+	seq_push(&input->line_offsets, 0);
+
+	seq_init(&input->line_times);
+	clock_gettime(CLOCK_MONOTONIC, &input->started);
+	input->timed = 1;
+}
+
+// Uses output which is already in memory, such as a mapped file.
+// The output must be followed by a NUL, and isn’t freed with the input.
+void
+input_attach (input_t* input, char* v, size_t nmemb)
+{
+	input->size = 0;
+	input->nmemb = nmemb;
+	input->v = v;
+	input->spill = -1;
+	input->timed = 0;
+
 	input->nlines = 0;
-	input->line_offset_size = BUFSIZ;
-	input->line_offsets = calloc(input->line_offset_size, sizeof(*input->line_offsets));
-	input->line_offsets[0] = 0;
+	seq_init(&input->line_offsets);
+	seq_push(&input->line_offsets, 0);
+	seq_init(&input->line_times);
+	index_lines(input, 0, nmemb);
 }
 
 void
 input_free (input_t* input)
 {
-	if(input->size > 0)
+	if(input->spill >= 0) {
+		munmap(input->v, input->size);
+		close(input->spill);
+	} else if(input->size > 0)
 		free(input->v);
-	if(input->line_offset_size > 0)
-		free(input->line_offsets);
+	seq_free(&input->line_offsets);
+	seq_free(&input->line_times);
 }
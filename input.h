@@ -4,31 +4,78 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
+#include "seq.h"
 
 typedef struct {
 	size_t size;
 	size_t nmemb;
 
-	size_t nlines; // number of display lines
+	size_t nlines; // number of newlines; line nlines is the last line
 
-	size_t *line_offsets;
-	size_t line_offset_size; // current size of line_offsets array
+	seq_t line_offsets;
+
+	// Milliseconds from input_init until each line ended, for output read
+	// as it arrives (not attached)
+	seq_t line_times;
+	struct timespec started;
+	int timed;
 
 	char *v;
+
+	// Beyond spill_at bytes, v is mapped from a deleted temporary file
+	// instead, so that output larger than memory can still be captured
+	size_t spill_at;
+	int spill;     // the file, or -1 while v is on the heap
 } input_t;
 
+#define INPUT_SPILL ((size_t)256 << 20)
+
 void input_init (input_t* input);
+void input_attach (input_t* input, char* v, size_t nmemb);
 void input_free (input_t* input);
 
-size_t input_read (input_t* input, int fd, int width, int echo);
+size_t input_read (input_t* input, int fd);
+void input_append (input_t* input, const char* s, size_t n);
 
+size_t input_line_offset (input_t* input, size_t index);
+
+// When a line ended, in milliseconds from the start, or -1 if not known
+long input_line_time (input_t* input, size_t index);
 size_t find_line_index (input_t* input, size_t offset);
 
-size_t find_end_offset (input_t* input, size_t stop_offset, size_t height);
+// Display rows of a line when wrapped to width
+size_t input_rows (input_t* input, size_t index, int width);
+
+// Fills rows with the starts of up to height display rows around offset,
+// followed by the end of the last one, returning the number of rows.
+size_t input_layout (input_t* input, size_t offset, int width, size_t height, size_t* rows);
+
+// The same for the last height display rows of the input
+size_t input_layout_tail (input_t* input, int width, size_t height, size_t* rows);
+
+// Number of display rows above the end of the input, up to max
+size_t input_rows_back (input_t* input, int width, size_t max);
+
+// Offset of the first of the last max display rows
+size_t input_tail (input_t* input, int width, size_t max);
+
+// A display row start kept between calls of input_tail_mark
+typedef struct {
+	size_t line;
+	size_t offset;
+	int width;      // 0 if unset
+} input_mark_t;
+
+// input_tail for output which is still being added to, setting rows to the
+// number found, up to max.  The line the mark is in is wrapped from the
+// mark rather than its start, so that a long last line isn't wrapped again
+// whole each time; the mark is then moved to the row returned.
+size_t input_tail_mark (input_t* input, int width, size_t max, input_mark_t* mark, size_t* rows);
 
 // (private)
-char* find_next_line (char* s, int width);
+char* find_next_line (char* s, char* end, int width);
 char* consume_escape_seq (char* c);
 
 #endif
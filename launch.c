@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "launch.h"
+
+#define RPC_TIMEOUT 2000 // milliseconds to wait for nvim to reply
+
+extern char** environ;
+
+int
+launch_wait (char* const argv[])
+{
+	posix_spawnattr_t attr;
+	struct sigaction ignore, old_int, old_quit;
+	sigset_t defaults;
+	pid_t pid;
+	int status = -1;
+
+	// The editor gets the usual ^C handling, while we ignore it as system() does
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGINT);
+	sigaddset(&defaults, SIGQUIT);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGINT, &ignore, &old_int);
+	sigaction(SIGQUIT, &ignore, &old_quit);
+
+	if ((errno = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ)) != 0) {
+		perror(argv[0]);
+	} else {
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGQUIT, &old_quit, NULL);
+	posix_spawnattr_destroy(&attr);
+
+	return status;
+}
+
+// Appends a msgpack string
+static unsigned char*
+pack_str (unsigned char* out, const char* s, size_t n)
+{
+	if (n < 32) {
+		*out++ = 0xa0 | n;
+	} else if (n < 0x100) {
+		*out++ = 0xd9;
+		*out++ = n;
+	} else {
+		*out++ = 0xda;
+		*out++ = n >> 8;
+		*out++ = n;
+	}
+
+	memcpy(out, s, n);
+	return out + n;
+}
+
+// Sends one nvim_command request over the msgpack-RPC socket, and waits
+// for the reply so that nvim has opened the file before we carry on.
+static int
+nvim_open (const char* socket_path, const char* path, long line, long column)
+{
+	char cmd[2*PATH_MAX + 96], reply[256];
+	unsigned char request[sizeof(cmd) + 32];
+	struct sockaddr_un addr;
+	struct pollfd pfd;
+	const char* p;
+	unsigned char* r = request;
+	char* c = cmd;
+	int fd, ok;
+
+	if (!socket_path || !strchr(socket_path, '/') || strlen(socket_path) >= sizeof(addr.sun_path))
+		return 0;
+
+	// Single quoted, with any quotes doubled
+	c += sprintf(c, "execute 'edit' fnameescape('");
+	for (p = path; *p; ++p)
+	{
+		if (*p == '\'')
+			*c++ = '\'';
+		*c++ = *p;
+	}
+	c += sprintf(c, "') | call cursor(%ld, %ld)", line, column);
+
+	*r++ = 0x94;  // [type, msgid, method, params]
+	*r++ = 0x00;  // request
+	*r++ = 0x01;
+	r = pack_str(r, "nvim_command", strlen("nvim_command"));
+	*r++ = 0x91;
+	r = pack_str(r, cmd, c - cmd);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 0;
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    write(fd, request, r - request) != r - request) {
+		close(fd);
+		return 0;
+	}
+
+	// [1, msgid, error, result], where a nil error is success
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	ok = poll(&pfd, 1, RPC_TIMEOUT) > 0 && read(fd, reply, sizeof(reply)) >= 4;
+	if (ok && (unsigned char)reply[3] != 0xc0)
+		fprintf(stderr, "\033[1mError\033[0m: nvim couldn’t open %s\n", path);
+
+	close(fd);
+
+	return ok;
+}
+
+int
+launch_remote (const char* path, long line, long column)
+{
+	const char* server = getenv("PLS_SERVER");
+	char absolute[PATH_MAX], cwd[PATH_MAX], position[64], name[64];
+	char* argv[7] = { NULL };
+
+	if (!server || !*server)
+		return 0;
+
+	// The server may well be running somewhere else
+	if (path[0] != '/' && getcwd(cwd, sizeof(cwd)) &&
+	    (size_t)snprintf(absolute, sizeof(absolute), "%s/%s", cwd, path) < sizeof(absolute))
+		path = absolute;
+
+	if (strcmp(server, "emacs") == 0) {
+		snprintf(position, sizeof(position), "+%ld:%ld", line, column);
+		argv[0] = "emacsclient";
+		argv[1] = "-n";
+		argv[2] = position;
+		argv[3] = (char*)path;
+	} else if (strncmp(server, "vim", 3) == 0 && (server[3] == '\0' || server[3] == ':')) {
+		snprintf(name, sizeof(name), "%s", server[3] ? server+4 : "VIM");
+		snprintf(position, sizeof(position), "+call cursor(%ld, %ld)", line, column);
+		argv[0] = "vim";
+		argv[1] = "--servername";
+		argv[2] = name;
+		argv[3] = "--remote-silent";
+		argv[4] = position;
+		argv[5] = (char*)path;
+	} else {
+		// Either "nvim" from within one of its terminals, or a socket path
+		if (strcmp(server, "nvim") == 0 && !(server = getenv("NVIM")))
+			server = getenv("NVIM_LISTEN_ADDRESS");
+		return nvim_open(server, path, line, column);
+	}
+
+	return launch_wait(argv) == 0;
+}
@@ -0,0 +1,14 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+// Runs argv in the foreground, like system() without a shell.
+// Returns the wait status, or -1 if it couldn’t be started.
+int launch_wait (char* const argv[]);
+
+// Opens path at line and column in an editor that’s already running, as
+// chosen by PLS_SERVER: "nvim" (or the path of its socket), "emacs", or
+// "vim" (or "vim:NAME" for a server name other than VIM).
+// Returns 0 if there’s no server to use.
+int launch_remote (const char* path, long line, long column);
+
+#endif
@@ -2,18 +2,24 @@
 #include <assert.h>
 #include <unistd.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "patterns.h"
-
-#define MAX_FIELDS 100
+#include "ansi.h"
 
 static size_t field_count = 0;
+static size_t field_size = 0; // current size of field_offsets array
 static struct field_t {
-	struct {
+	struct span_t {
 		size_t start;
 		size_t stop;
 	} match, path, line, column;
-	int path_index;
-} field_offsets[MAX_FIELDS];
+	int path_index; // where the file was found, or -1 until it's looked for
+	int pattern;    // index of the pattern which matched
+	int ambiguous;  // tracked files a partial path could be, if several
+} *field_offsets = NULL;
 
 typedef int (valid_field_t) (const char* s, struct field_t* field);
 
@@ -27,7 +33,7 @@ match_line (const char* line, int length, size_t offset, pattern_list_t* list, s
 	for (i = 0; i < list->count; ++i) {
 		pattern_t* pattern = &list->patterns[i];
 
-		pcreExecRet = pcre_exec(pattern->compiled, pattern->extra, line, length, 0, 0, subStrVec, sizeof(subStrVec) / sizeof(int));
+		pcreExecRet = pattern_exec(pattern, line, length, subStrVec, sizeof(subStrVec) / sizeof(int));
 
 		if (pcreExecRet > 0) {
 			if (pcreExecRet == 1) {
@@ -35,6 +41,7 @@ match_line (const char* line, int length, size_t offset, pattern_list_t* list, s
 				continue;
 			}
 
+			field->pattern = i;
 			field->match.start = offset+subStrVec[0];
 			field->match.stop  = offset+subStrVec[1];
 
@@ -57,22 +64,65 @@ match_line (const char* line, int length, size_t offset, pattern_list_t* list, s
 	return 0;
 }
 
-int study (pattern_list_t* patterns, const char *s, size_t length, valid_field_t* valid_field)
+// Moves a range of the clean text back to the original
+void
+map_span (shadow_t* shadow, struct span_t* span)
+{
+	if (span->stop > span->start) {
+		span->start = shadow_raw_start(shadow, span->start);
+		span->stop = shadow_raw_stop(shadow, span->stop);
+	}
+}
+
+void
+map_field (shadow_t* shadow, struct field_t* field)
 {
+	map_span(shadow, &field->match);
+	map_span(shadow, &field->path);
+	map_span(shadow, &field->line);
+	map_span(shadow, &field->column);
+}
+
+void
+shift_span (struct span_t* span, size_t base)
+{
+	// An empty span at 0 is one that didn’t match
+	if (span->stop > 0) {
+		span->start += base;
+		span->stop += base;
+	}
+}
+
+// Moves a field found in part of the output to where that part is
+void
+shift_field (struct field_t* field, size_t base)
+{
+	shift_span(&field->match, base);
+	shift_span(&field->path, base);
+	shift_span(&field->line, base);
+	shift_span(&field->column, base);
+}
+
+#define STUDY_CHUNK 65536 // bytes of output stripped of escape sequences at once
+
+// Matches each line of the stripped text in shadow, which is of the output
+// from base on
+static void
+study_chunk (pattern_list_t* patterns, shadow_t* shadow, size_t base, valid_field_t* valid_field,
+             struct field_t** fields, size_t* count, size_t* size)
+{
+	const char* s = shadow->v;
+	size_t length = shadow->nmemb;
 	const char* line;
-	char* newline;
+	const char* newline;
 	size_t offset;
 	int lineLength;
 	struct field_t field;
 
-	assert(length > 0);
-
-	field_count = 0;
-
 	for (offset = 0; offset < length; ) {
 		line = s+offset;
 
-		newline = strchr(line, '\n');
+		newline = memchr(line, '\n', length-offset);
 
 		if (newline != NULL) {
 			lineLength = newline - line;
@@ -83,63 +133,342 @@ int study (pattern_list_t* patterns, const char *s, size_t length, valid_field_t
 		memset(&field, 0, sizeof(field));
 		if (match_line(line, lineLength, offset, patterns, &field)) {
 			if (!valid_field || valid_field(s, &field)) {
-				field_offsets[field_count] = field;
-				field_count++;
+				if (*count == *size) {
+					*size = *size ? *size*2 : BUFSIZ;
+					*fields = realloc(*fields, *size*sizeof(**fields));
+					if (!*fields) {
+						perror("realloc");
+						exit(1);
+					}
+				}
 
-				if (field_count == MAX_FIELDS)
-					break;
+				map_field(shadow, &field);
+				shift_field(&field, base);
+				(*fields)[*count] = field;
+				++*count;
 			}
 		}
 
 		offset += lineLength+1;
 	}
+}
+
+// Matches each line of s, appending the fields found to an array of them.
+// Only the array given is touched, so chunks can be studied in parallel.
+int study_fields (pattern_list_t* patterns, const char *s, size_t length, valid_field_t* valid_field,
+                  struct field_t** fields, size_t* count, size_t* size)
+{
+	const char* newline;
+	size_t start, stop;
+	shadow_t shadow;
+
+	assert(length > 0);
+
+	shadow_init(&shadow);
+
+	// Patterns see the text without colours or other escape sequences.  It’s
+	// stripped a chunk of whole lines at a time, so that output too big for
+	// memory (kept in a file) isn’t copied whole.
+	for (start = 0; start < length; start = stop)
+	{
+		stop = length - start > STUDY_CHUNK ? start + STUDY_CHUNK : length;
+		if (stop < length && (newline = memchr(s + stop - 1, '\n', length - stop + 1)))
+			stop = newline - s + 1;
+		else if (stop < length)
+			stop = length;
+
+		shadow_clear(&shadow);
+		ansi_strip(&shadow, s + start, stop - start);
+		study_chunk(patterns, &shadow, start, valid_field, fields, count, size);
+	}
+
+	shadow_free(&shadow);
 
 	return 1;
 }
 
+int study (pattern_list_t* patterns, const char *s, size_t length, valid_field_t* valid_field)
+{
+	field_count = 0;
+
+	return study_fields(patterns, s, length, valid_field, &field_offsets, &field_count, &field_size);
+}
+
+// Replaces the first placeholder in out, which must have room for the result
 int
 replace (char* out, const char* placeholder, const char* in, int length)
 {
-	char buf[200] = {0};
 	char* pos = strstr(out, placeholder);
+	const char* nul = memchr(in, '\0', length);
+	size_t n = strlen(placeholder);
 
 	if (pos == NULL)
 		return 0;
 
-	strncat(buf, out, pos-out);
-	strncat(buf, in, length);
-	strcat(buf, pos+strlen(placeholder));
-	strcpy(out, buf);
+	if (nul)
+		length = nul - in;
+
+	memmove(pos+length, pos+n, strlen(pos+n)+1);
+	memcpy(pos, in, length);
 
 	return 1;
 }
 
+// The path of a field, under the search path it was found in if any
+void
+field_path (char* out, size_t size, const char* s, struct field_t const* field, const char* path)
+{
+	int length = field->path.stop - field->path.start;
+
+	if (path)
+		snprintf(out, size, "%s/%.*s", path, length, s+field->path.start);
+	else
+		snprintf(out, size, "%.*s", length, s+field->path.start);
+}
+
+// The line or column number of a field, or 0 if it has none
+long
+field_number (const char* s, struct span_t span)
+{
+	long n = 0;
+	size_t i;
+
+	for (i = span.start; span.start > 0 && i < span.stop; ++i)
+		n = n*10 + (s[i] - '0');
+
+	return n;
+}
+
+static int
+span_within (struct span_t span, size_t length)
+{
+	return span.start <= span.stop && span.stop <= length;
+}
+
+// Whether every span of the fields lies within length bytes of output,
+// as fields read back from a file may not
 int
-format_cmd (char* out, const char* s, struct field_t const* field, const char* path)
+fields_within (const struct field_t* fields, size_t count, size_t length)
 {
-	if(field->line.start > 0)
-			replace(out, "%d", s+field->line.start, field->line.stop-field->line.start);
-	else	replace(out, "%d", "0", 1);
+	size_t i;
 
-	if(field->column.start > 0)
-			replace(out, "%d", s+field->column.start, field->column.stop-field->column.start);
-	else	replace(out, "%d", "0", 1);
+	for (i = 0; i < count; ++i)
+		if (!span_within(fields[i].match, length) || !span_within(fields[i].path, length) ||
+		    !span_within(fields[i].line, length) || !span_within(fields[i].column, length))
+			return 0;
+
+	return 1;
+}
+
+static uint64_t
+hash_bytes (uint64_t h, const char* s, size_t n)
+{
+	while (n-- > 0)
+		h = (h ^ (unsigned char)*s++) * 1099511628211u;
+
+	return h;
+}
 
-	char buf[PATH_MAX] = {0};
-	if (path) {
-		strcat(buf, path);
-		strcat(buf, "/");
+// A hash of what a field says, to know it again in the output of another
+// run: its path, line and column, and the rest of its line.  Escape
+// sequences are left out, and runs of spaces or digits count as one, since
+// timings and counts change from run to run.  The output must end in a NUL.
+uint64_t
+field_hash (const char* s, size_t length, const struct field_t* field)
+{
+	uint64_t h = 14695981039346656037u;
+	long numbers[2];
+	size_t start = field->match.start, stop = field->match.stop;
+	const char* p;
+	const char* end;
+	const char* next;
+	char c, last = 0;
+
+	h = hash_bytes(h, s + field->path.start, field->path.stop - field->path.start);
+	numbers[0] = field_number(s, field->line);
+	numbers[1] = field_number(s, field->column);
+	h = hash_bytes(h, (const char*)numbers, sizeof(numbers));
+
+	while (start > 0 && s[start-1] != '\n')
+		--start;
+	while (stop < length && s[stop] != '\n')
+		++stop;
+
+	for (p = s + start, end = s + stop; p < end; )
+	{
+		// The match itself is already counted
+		if (p >= s + field->match.start && p < s + field->match.stop) {
+			p = s + field->match.stop;
+			continue;
+		}
+		if (*p == '\033') {
+			next = ansi_skip(p);
+			p = next > p ? next : p + 1;
+			continue;
+		}
+
+		c = *p++;
+		if (c == '\t' || c == '\r')
+			c = ' ';
+		else if (c >= '0' && c <= '9')
+			c = '0';
+		if (c != last || (c != ' ' && c != '0'))
+			h = hash_bytes(h, &c, 1);
+		last = c;
 	}
-	strncat(buf, s+field->path.start, field->path.stop-field->path.start);
-
-	if (!replace(out, "%s", buf, PATH_MAX)) {
-		// If there’s no explicit placeholder for the file path,
-		// we append it to the end of the command.
-		size_t len = strlen(out);
-		if(out[len-1] != ' ')
-			strcat(out, " ");
-		strcat(out, buf);
+
+	return h;
+}
+
+// Copies a word of an editor command with the first two %d replaced by the
+// line and column, and the first %s by the path.  The count of %d seen so
+// far is carried across words in nth.
+char*
+format_word (const char* word, const char* values[3], int* nth, int* has_path)
+{
+	char* out = malloc(strlen(word) + strlen(values[0]) + strlen(values[1]) + strlen(values[2]) + 1);
+	char* o = out;
+	const char* value;
+
+	if (!out) {
+		perror("malloc");
+		exit(1);
 	}
 
-	return 1;
+	while (*word)
+	{
+		value = NULL;
+		if (word[0] == '%' && word[1] == 'd' && *nth < 2)
+			value = values[(*nth)++];
+		else if (word[0] == '%' && word[1] == 's' && !*has_path) {
+			value = values[2];
+			*has_path = 1;
+		}
+
+		if (value) {
+			strcpy(o, value);
+			o += strlen(value);
+			word += 2;
+		} else {
+			*o++ = *word++;
+		}
+	}
+	*o = '\0';
+
+	return out;
+}
+
+static void
+format_values (char line[32], char column[32], const char* s, struct field_t const* field)
+{
+	snprintf(line, 32, "%ld", field_number(s, field->line));
+	snprintf(column, 32, "%ld", field_number(s, field->column));
+}
+
+// Fills in the editor command in out, which holds size bytes.  Returns 0
+// if the result doesn’t fit.
+int
+format_cmd (char* out, size_t size, const char* s, struct field_t const* field, const char* path)
+{
+	char line[32], column[32], buf[PATH_MAX];
+	const char* values[3] = { line, column, buf };
+	int nth = 0, has_path = 0, n;
+	char* cmd;
+
+	format_values(line, column, s, field);
+	field_path(buf, sizeof(buf), s, field, path);
+
+	cmd = format_word(out, values, &nth, &has_path);
+
+	// If there’s no explicit placeholder for the file path,
+	// we append it to the end of the command.
+	if (has_path)
+		n = snprintf(out, size, "%s", cmd);
+	else
+		n = snprintf(out, size, "%s%s%s", cmd, cmd[0] && cmd[strlen(cmd)-1] == ' ' ? "" : " ", buf);
+	free(cmd);
+
+	return n >= 0 && (size_t)n < size;
+}
+
+// As format_cmd, but for a command already split into words, so that no
+// shell is needed to run it.  The result is NULL terminated, and freed with
+// free_argv.
+char**
+format_argv (char* const* words, size_t count, const char* s, struct field_t const* field, const char* path)
+{
+	char line[32], column[32], buf[PATH_MAX];
+	const char* values[3] = { line, column, buf };
+	int nth = 0, has_path = 0;
+	char** argv = calloc(count + 2, sizeof(*argv));
+	size_t i;
+
+	if (!argv) {
+		perror("calloc");
+		exit(1);
+	}
+
+	format_values(line, column, s, field);
+	field_path(buf, sizeof(buf), s, field, path);
+
+	for (i = 0; i < count; ++i)
+		argv[i] = format_word(words[i], values, &nth, &has_path);
+
+	if (!has_path)
+		argv[i] = format_word("%s", values, &nth, &has_path);
+
+	return argv;
+}
+
+// As format_argv, for several fields opened at once: the words with
+// placeholders (along with an option just before them, as in --line %d)
+// are repeated for each field, as is the path when it’s appended.
+char**
+format_argv_each (char* const* words, size_t count, const char* s, struct field_t const* const* fields, const char* const* paths, size_t n)
+{
+	size_t group, i, j, argc = 0;
+	char** argv, **each;
+
+	for (group = 0; group < count; ++group)
+		if (strstr(words[group], "%d") || strstr(words[group], "%s"))
+			break;
+
+	if (group > 1 && group < count && words[group-1][0] == '-')
+		--group;
+
+	argv = calloc(group + n*(count - group + 1) + 1, sizeof(*argv));
+	if (!argv) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < group; ++i)
+	{
+		argv[argc] = malloc(strlen(words[i]) + 1);
+		if (!argv[argc]) {
+			perror("malloc");
+			exit(1);
+		}
+		strcpy(argv[argc++], words[i]);
+	}
+
+	for (j = 0; j < n; ++j)
+	{
+		each = format_argv(words + group, count - group, s, fields[j], paths[j]);
+		for (i = 0; each[i]; ++i)
+			argv[argc++] = each[i];
+		free(each);
+	}
+
+	return argv;
+}
+
+void
+free_argv (char** argv)
+{
+	size_t i;
+
+	for (i = 0; argv[i]; ++i)
+		free(argv[i]);
+	free(argv);
 }
@@ -1,15 +1,36 @@
 #include "patterns.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+
+static pattern_match_t match_path_line;
+static pattern_match_t match_file_line;
+static pattern_match_t match_in_on_line;
+static pattern_match_t match_path_parens;
+static pattern_match_t match_python;
 
 const char* default_patterns[] = {
-	// Handle a possible colour sequence from clang output.
-	"(?:\033\\[\\dm)?([\\/\\w\\-\\.]+\\.\\w+):(\\d+)(?::(\\d+))?",
+	// Patterns are matched against the output with escape sequences removed.
+	"([\\/\\w\\-\\.]+\\.\\w+):(\\d+)(?::(\\d+))?",
 	"file: ([\\/\\w.]+) line: (\\d+)",
 	"in (.+?) on line (\\d+)",
 	"([\\/\\w.]+)\\((\\d+),(\\d+)\\)",
 	"File \"(.+?)\", line (\\d+)",
 };
+const int default_pattern_count = sizeof(default_patterns)/sizeof(*default_patterns);
+
+// Hand-written equivalents of the default patterns, which account for most
+// matches.  They give the same captures as PCRE: see test_native in test.c.
+static pattern_match_t* default_matchers[] = {
+	match_path_line,
+	match_file_line,
+	match_in_on_line,
+	match_path_parens,
+	match_python,
+};
 
 void
 init_patterns (pattern_list_t* list)
@@ -17,12 +38,35 @@ init_patterns (pattern_list_t* list)
 	list->count = 0;
 }
 
+static pattern_t*
+new_pattern (pattern_list_t* list, const char* str)
+{
+	pattern_t* pattern;
+
+	if (list->count+1 == MAX_PATTERNS)
+		return NULL;
+
+	pattern = &list->patterns[list->count];
+	memset(pattern, 0, sizeof(*pattern));
+	pattern->required = -1;
+
+	pattern->str = calloc(strlen(str)+1, sizeof(*str));
+	strcpy(pattern->str, str);
+
+	++list->count;
+
+	return pattern;
+}
+
 void
 add_default_patterns (pattern_list_t* list)
 {
-	size_t n;
-	for(n = 0; n < sizeof(default_patterns)/sizeof(*default_patterns); ++n)
-		add_pattern(list, default_patterns[n]);
+	pattern_t* pattern;
+	int n;
+
+	for(n = 0; n < default_pattern_count; ++n)
+		if ((pattern = new_pattern(list, default_patterns[n])))
+			pattern->native = default_matchers[n];
 }
 
 int
@@ -30,15 +74,11 @@ add_pattern (pattern_list_t* list, const char* str)
 {
 	const char *pcreErrorStr;
 	int pcreErrorOffset;
+	pattern_t* pattern = new_pattern(list, str);
 
-	if (list->count+1 == MAX_PATTERNS)
+	if (!pattern)
 		return 0;
 
-	pattern_t* pattern = &list->patterns[list->count];
-
-	pattern->str = calloc(strlen(str)+1, sizeof(*str));
-	strcpy(pattern->str, str);
-
 	pattern->compiled = pcre_compile(pattern->str, 0, &pcreErrorStr, &pcreErrorOffset, NULL);
 	if (pcreErrorStr) {
 		fprintf(stderr, "\033[1mError\033[0m: Could not compile '%s': %s\n", pattern->str, pcreErrorStr);
@@ -51,7 +91,334 @@ add_pattern (pattern_list_t* list, const char* str)
 		exit(1);
 	}
 
-	++list->count;
+	if (pcre_fullinfo(pattern->compiled, pattern->extra, PCRE_INFO_LASTLITERAL, &pattern->required) != 0)
+		pattern->required = -1;
+
+	// Patterns with nothing to study have no extra data to set limits in
+	if (!pattern->extra && !(pattern->extra = calloc(1, sizeof(*pattern->extra)))) {
+		perror("calloc");
+		exit(1);
+	}
+	pattern->extra->flags |= PCRE_EXTRA_MATCH_LIMIT | PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+	pattern->extra->match_limit = PATTERN_MATCH_LIMIT;
+	pattern->extra->match_limit_recursion = PATTERN_RECURSION_LIMIT;
 
 	return 1;
 }
+
+// Character classes as PCRE has them, in ASCII
+static int
+is_digit (char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static int
+is_word (char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) || c == '_';
+}
+
+// [\/\w.]
+static int
+is_path (char c)
+{
+	return is_word(c) || c == '/' || c == '.';
+}
+
+static int
+digits (const char* s, int i, int length)
+{
+	while (i < length && is_digit(s[i]))
+		++i;
+	return i;
+}
+
+static int
+find (const char* s, int i, int length, const char* needle, int n)
+{
+	const char* p;
+
+	while (i + n <= length && (p = memchr(s + i, needle[0], length - n + 1 - i)))
+	{
+		i = p - s;
+		if (memcmp(p, needle, n) == 0)
+			return i;
+		++i;
+	}
+	return -1;
+}
+
+// The start of the run of path characters ending at stop
+static int
+path_start (const char* s, int stop, int dash)
+{
+	while (stop > 0 && (is_path(s[stop-1]) || (dash && s[stop-1] == '-')))
+		--stop;
+	return stop;
+}
+
+// ([\/\w\-\.]+\.\w+):(\d+)(?::(\d+))?
+//
+// The path can’t contain the colon, so it’s the whole run of path
+// characters before a colon and digit, and must end with a dot and word
+// characters.  Colons are rare, so they’re looked for first.
+static int
+match_path_line (const char* s, int length, int* v)
+{
+	int start, stop = 0, word;
+
+	while ((stop = find(s, stop, length, ":", 1)) >= 0)
+	{
+		start = path_start(s, stop, 1);
+		for (word = stop; word > start && is_word(s[word-1]); --word)
+			;
+
+		if (word < stop && word-1 > start && s[word-1] == '.' &&
+				stop+1 < length && is_digit(s[stop+1])) {
+			v[0] = v[2] = start;
+			v[3] = stop;
+			v[4] = stop+1;
+			v[5] = v[1] = digits(s, stop+1, length);
+
+			if (v[5]+1 < length && s[v[5]] == ':' && is_digit(s[v[5]+1])) {
+				v[6] = v[5]+1;
+				v[7] = v[1] = digits(s, v[6], length);
+				return 4;
+			}
+			return 3;
+		}
+
+		++stop;
+	}
+
+	return PCRE_ERROR_NOMATCH;
+}
+
+// file: ([\/\w.]+) line: (\d+)
+static int
+match_file_line (const char* s, int length, int* v)
+{
+	int start = 0, stop;
+
+	while ((start = find(s, start, length, "file: ", 6)) >= 0)
+	{
+		for (stop = start+6; stop < length && is_path(s[stop]); ++stop)
+			;
+
+		if (stop > start+6 && stop+7 < length && memcmp(s + stop, " line: ", 7) == 0 && is_digit(s[stop+7])) {
+			v[0] = start;
+			v[2] = start+6;
+			v[3] = stop;
+			v[4] = stop+7;
+			v[5] = v[1] = digits(s, stop+7, length);
+			return 3;
+		}
+
+		++start;
+	}
+
+	return PCRE_ERROR_NOMATCH;
+}
+
+// A prefix, then the shortest path followed by a suffix and line number.
+// Only the first prefix need be tried: if nothing follows it, nothing
+// follows a later one either.
+static int
+match_lazy (const char* s, int length, int* v, const char* prefix, int nprefix, const char* suffix, int nsuffix)
+{
+	int start, stop;
+
+	if ((start = find(s, 0, length, prefix, nprefix)) < 0)
+		return PCRE_ERROR_NOMATCH;
+
+	for (stop = start + nprefix + 1; (stop = find(s, stop, length, suffix, nsuffix)) >= 0; ++stop)
+	{
+		if (stop + nsuffix < length && is_digit(s[stop + nsuffix])) {
+			v[0] = start;
+			v[2] = start + nprefix;
+			v[3] = stop;
+			v[4] = stop + nsuffix;
+			v[5] = v[1] = digits(s, v[4], length);
+			return 3;
+		}
+	}
+
+	return PCRE_ERROR_NOMATCH;
+}
+
+// in (.+?) on line (\d+)
+static int
+match_in_on_line (const char* s, int length, int* v)
+{
+	return match_lazy(s, length, v, "in ", 3, " on line ", 9);
+}
+
+// File "(.+?)", line (\d+)
+static int
+match_python (const char* s, int length, int* v)
+{
+	return match_lazy(s, length, v, "File \"", 6, "\", line ", 8);
+}
+
+// ([\/\w.]+)\((\d+),(\d+)\)
+static int
+match_path_parens (const char* s, int length, int* v)
+{
+	int start, stop = 0, comma, end;
+
+	while ((stop = find(s, stop, length, "(", 1)) >= 0)
+	{
+		start = path_start(s, stop, 0);
+
+		if (start < stop && stop+1 < length && is_digit(s[stop+1])) {
+			comma = digits(s, stop+1, length);
+			if (comma+1 < length && s[comma] == ',' && is_digit(s[comma+1])) {
+				end = digits(s, comma+1, length);
+				if (end < length && s[end] == ')') {
+					v[0] = v[2] = start;
+					v[3] = stop;
+					v[4] = stop+1;
+					v[5] = comma;
+					v[6] = comma+1;
+					v[7] = end;
+					v[1] = end+1;
+					return 4;
+				}
+			}
+		}
+
+		++stop;
+	}
+
+	return PCRE_ERROR_NOMATCH;
+}
+
+static pthread_mutex_t cost_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Adds a match's CPU time and bytes to the pattern's totals, counts it if
+// it went over PCRE's limits, and quarantines the pattern once that's
+// happened too often or the time is too far beyond what the bytes should
+// take.  Returns whether the pattern is quarantined.
+static int
+account (pattern_t* pattern, int rc, double seconds, int bytes)
+{
+	int strikes = 0, quarantined;
+	double excess;
+
+	pthread_mutex_lock(&cost_lock);
+	if (rc == PCRE_ERROR_MATCHLIMIT || rc == PCRE_ERROR_RECURSIONLIMIT)
+		strikes = ++pattern->strikes;
+	pattern->seconds += seconds;
+	pattern->bytes += bytes;
+	excess = pattern->seconds - pattern->bytes*PATTERN_BYTE_BUDGET;
+
+	// Warned about once, by whichever thread gets here first
+	if (!pattern->quarantined && (strikes >= PATTERN_STRIKES || excess > PATTERN_BUDGET)) {
+		pattern->quarantined = 1;
+		if (strikes >= PATTERN_STRIKES)
+			fprintf(stderr, "Warning: pattern '%s' went over its backtracking limit %d times, so won’t be used\n",
+			        pattern->str, strikes);
+		else
+			fprintf(stderr, "Warning: pattern '%s' took %.1fs longer than it should have, so won’t be used\n",
+			        pattern->str, excess);
+	}
+	quarantined = pattern->quarantined;
+	pthread_mutex_unlock(&cost_lock);
+
+	return quarantined;
+}
+
+static int
+is_quarantined (pattern_t* pattern)
+{
+	int quarantined;
+
+	pthread_mutex_lock(&cost_lock);
+	quarantined = pattern->quarantined;
+	pthread_mutex_unlock(&cost_lock);
+
+	return quarantined;
+}
+
+// Whether s has the byte c, in either case since it may be matched without
+static int
+has_byte (const char* s, int n, int c)
+{
+	return c < 0 || memchr(s, c, n) || (isalpha(c) && memchr(s, c ^ 0x20, n));
+}
+
+// Matches with PCRE, setting *quarantined if the pattern has now been
+static int
+exec (pattern_t* pattern, const char* s, int length, int options, int* ovector, int size, int* quarantined)
+{
+	struct timespec start, stop;
+	int rc;
+
+	// PCRE only looks for the byte every match needs itself in short
+	// subjects, and this spares timing lines which can’t match
+	if (!has_byte(s, length, pattern->required))
+		return PCRE_ERROR_NOMATCH;
+
+	// The thread's own CPU time, as other threads and a loaded machine
+	// would otherwise be charged to the pattern
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	rc = pcre_exec(pattern->compiled, pattern->extra, s, length, 0, options, ovector, size);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stop);
+
+	*quarantined = account(pattern, rc, (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec)/1e9, length);
+	return rc;
+}
+
+// Matches the window of n bytes from start
+static int
+exec_window (pattern_t* pattern, const char* s, int start, int n, int length, int* ovector, int size, int* quarantined)
+{
+	int options = (start > 0 ? PCRE_NOTBOL : 0) | (start + n < length ? PCRE_NOTEOL : 0);
+
+	return exec(pattern, s + start, n, options, ovector, size, quarantined);
+}
+
+int
+pattern_exec (pattern_t* pattern, const char* s, int length, int* ovector, int size)
+{
+	int start, n, rc, i, quarantined = 0;
+
+	// The built-in patterns take time in proportion to the line already
+	if (pattern->native)
+		return pattern->native(s, length, ovector);
+
+	if (is_quarantined(pattern))
+		return PCRE_ERROR_NOMATCH;
+
+	if (length <= PATTERN_WINDOW)
+		return exec(pattern, s, length, 0, ovector, size, &quarantined);
+
+	// A long line, such as minified code, is matched a window at a time so
+	// that a pattern which backtracks can’t take time in its square
+	for (start = 0; ; start += PATTERN_WINDOW - PATTERN_OVERLAP)
+	{
+		n = length - start < PATTERN_WINDOW ? length - start : PATTERN_WINDOW;
+		rc = exec_window(pattern, s, start, n, length, ovector, size, &quarantined);
+
+		// A match ending near the edge may have been cut short by it, as
+		// \d+ stops there.  It’s matched again from where it starts, in a
+		// window grown until the match ends well inside it.
+		while (rc > 0 && start + n < length && ovector[1] > n - PATTERN_OVERLAP)
+		{
+			start += ovector[0];
+			n = length - start < 2*n ? length - start : 2*n;
+			rc = exec_window(pattern, s, start, n, length, ovector, size, &quarantined);
+		}
+
+		if (rc > 0) {
+			for (i = 0; i < 2*rc && i < size/3*2; ++i)
+				if (ovector[i] >= 0)
+					ovector[i] += start;
+			return rc;
+		}
+
+		if (start + n == length || quarantined)
+			return PCRE_ERROR_NOMATCH;
+	}
+}
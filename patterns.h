@@ -2,13 +2,36 @@
 #define PATTERNS_H
 
 #include <pcre.h>
+#include <stddef.h>
 
 #define MAX_PATTERNS 100
+#define PATTERN_WINDOW 1024 // longest part of a line PCRE matches at once
+#define PATTERN_OVERLAP 256 // of consecutive windows; a match ending within it is retried
+
+// Limits on patterns from .plsrc, beyond which one is given up on for the
+// run rather than left to stall it
+#define PATTERN_MATCH_LIMIT 1000000   // calls of PCRE's match() per window
+#define PATTERN_RECURSION_LIMIT 10000 // depth of its recursion
+#define PATTERN_STRIKES 3             // windows stopped by those limits
+#define PATTERN_BYTE_BUDGET 100e-9    // CPU seconds a byte should take to match,
+#define PATTERN_BUDGET 1.0            // and seconds beyond that in all
+
+// Matches a line as pcre_exec would, filling ovector and returning the
+// number of pairs set, or PCRE_ERROR_NOMATCH
+typedef int (pattern_match_t) (const char* s, int length, int* ovector);
 
 typedef struct {
 	char* str;
 	pcre* compiled;
 	pcre_extra* extra;
+	pattern_match_t* native; // for the built-in patterns, instead of PCRE
+	int required;            // a byte in every match, or -1 if there’s none
+
+	// What PCRE has cost, kept under a lock as lines are matched in parallel
+	int strikes;
+	double seconds;
+	double bytes;
+	int quarantined;
 } pattern_t;
 
 typedef struct {
@@ -16,10 +39,21 @@ typedef struct {
 	int count;
 } pattern_list_t;
 
+// The built-in patterns, each of which has a native matcher
+extern const char* default_patterns[];
+extern const int default_pattern_count;
+
 void init_patterns (pattern_list_t* list);
 
 void add_default_patterns (pattern_list_t* list);
 
 int add_pattern (pattern_list_t* list, const char* str);
 
+// Matches with the pattern’s native matcher, or PCRE for those from .plsrc.
+// With PCRE, lines longer than PATTERN_WINDOW are matched in overlapping
+// windows.  A pattern which goes over its limits is quarantined with a
+// warning, and matches nothing after.  ovector needs room for at least 4
+// pairs.
+int pattern_exec (pattern_t* pattern, const char* s, int length, int* ovector, int size);
+
 #endif
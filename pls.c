@@ -1,42 +1,68 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <signal.h>
 #include <wordexp.h>
 #include "parse.h"
 #include "input.h"
+#include "width.h"
 #include "editor.h"
+#include "filter.h"
+#include "session.h"
+#include "watch.h"
+#include "launch.h"
+#include "report.h"
+#include "scan.h"
+#include "decompress.h"
+#include "gitindex.h"
+#include "preview.h"
+#include "daemon.h"
 
 static input_t in;
+static session_t session;
+static pattern_list_t patterns;
+static int watch_fd = -1;
 
 /* Terminal capabilities */
 #define T_ERASE_DOWN          "\033[J"
 #define T_COLUMN_ADDRESS      "\033[%dG"
+#define T_CURSOR_HOME         "\033[H"
 #define T_CURSOR_INVISIBLE    "\033[?25l"
 #define T_CURSOR_UP           "\033[%dA"
 #define T_CURSOR_VISIBLE      "\033[?25h"
 #define T_ENTER_CA_MODE       "\033[?1049h"
 #define T_ENTER_STANDOUT_MODE "\033[7m"
+#define T_ENTER_UNDERLINE_MODE "\033[4m"
 #define T_EXIT_CA_MODE        "\033[?1049l"
 #define T_RESET_SGR           "\033[0m"
 
 #define ESCAPE      27
+#define BACKSPACE   127
 #define UP_ARROW    65
 #define DOWN_ARROW  66
 #define RIGHT_ARROW 67
 #define LEFT_ARROW  68
+#define HOME        72
+#define END         70
+
+#define CSI(c) (256 + (c)) // keys sent as escape sequences, by their final byte
 
 #define CONTROL(c) (c ^ 0x40)
 #define MAX(x, y) (x > y ? x : y)
 #define MIN(x, y) (x < y ? x : y)
 
+#define PIPES 2 // the utility’s output and errors
+
 static const char **utility;
 
 static struct {
@@ -50,23 +76,56 @@ static struct {
 
 static void args(int, const char **);
 static void editor(void);
+static int resolve_field(const char *, struct field_t *, char [PATH_MAX]);
+static void rerun_start(void);
+static int rerun_finish(void);
+static void save_session(void);
+static void diff_previous(void);
+static int stream_read(int);
+static int stop_early(size_t *);
+static pid_t spawn_utility(int [PIPES], int);
+static int follow_read(fd_set *);
+static void follow_update(void);
 
 static void tend(void);
-static void tdraw(const char *s, size_t start, size_t stop);
+static size_t tdraw(const char *s, size_t start, size_t stop, int marked);
+static size_t tpreview(size_t, size_t);
 static void tmain(void);
 static void tprintf(const char *, int);
 static void tputs(const char *);
+static void tstatus(size_t);
 static void tsetup(void);
+static void tsize(void);
 static void twrite(const char *, size_t);
 
 static ssize_t xwrite(int, const char *, size_t);
 
 static int selection_index = -1;
+static unsigned char *marks; // fields marked to open together
+static size_t mark_count;
+
+// Fields which the last run of the same command in the same directory
+// didn’t have, so they can be listed alone
+static struct {
+	unsigned char* fresh; // for each field, or NULL with no run to compare
+	size_t count;
+	int only;             // list only the new fields
+} diff;
 
 static struct {
 	int initial_last; // start with last field selected instead of first
 	int always_select;
 	int only_existing;
+	int last;         // reopen this cached session, counting back from 1
+	int list_sessions;
+	int watch;        // rerun the utility when files change
+	enum report_format format; // write matches to stdout instead of selecting
+	int recursive;    // scan log files under directories
+	int scan;         // the arguments are log files, not a utility
+	int timing;       // report where the time went instead of selecting
+	int first;        // stop reading at the first match
+	int follow;       // keep reading output while selecting
+	int kill_utility; // and then kill the utility, rather than leave it running
 
 	char* paths[100];
 	int path_count;
@@ -76,8 +135,15 @@ void
 args(int argc, const char **argv)
 {
 	int c, i;
-
-	while ((c = getopt(argc, (char * const *) argv, "lavehp:")) != -1) {
+	static struct option long_options[] = {
+		{ "last",     optional_argument, NULL, 'L' },
+		{ "sessions", no_argument,       NULL, 'S' },
+		{ "format",   required_argument, NULL, 'F' },
+		{ "timing",   no_argument,       NULL, 'T' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((c = getopt_long(argc, (char * const *) argv, "+lavehp:wr1kf", long_options, NULL)) != -1) {
 		switch (c) {
 		case 'v':
 			puts("pls " VERSION);
@@ -95,15 +161,62 @@ args(int argc, const char **argv)
 			options.paths[options.path_count] = optarg;
 			++options.path_count;
 			break;
+		case 'w':
+			options.watch = 1;
+			break;
+		case 'r':
+			options.recursive = 1;
+			break;
+		case 'L':
+			options.last = optarg ? atoi(optarg) : 1;
+			if (options.last < 1) {
+				fprintf(stderr, "\033[1mError\033[0m: invalid session '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'S':
+			options.list_sessions = 1;
+			break;
+		case 'F':
+			if (!(options.format = report_format(optarg))) {
+				fprintf(stderr, "\033[1mError\033[0m: unknown format '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'T':
+			options.timing = 1;
+			break;
+		case '1':
+			options.first = 1;
+			break;
+		case 'k':
+			options.kill_utility = 1;
+			break;
+		case 'f':
+			options.follow = 1;
+			break;
 		case 'h':
 		default:
-			puts("usage: pls [-lae] [-p path] utility\n");
+			puts("usage: pls [-laew1kf] [-p path] utility\n"
+			     "       pls [-laer] [-p path] file ...\n"
+			     "       pls [-e] [-p path] --format=json|quickfix|sarif [utility | [-r] file ...]\n"
+			     "       pls --timing [utility]\n"
+			     "       pls --last[=n] | --sessions\n");
 			if (c == 'h') {
 				puts("Arguments:"
 				"\n  -e          Only select existing filenames"
 				"\n  -l          Set initial selection to the last path"
 				"\n  -p          Add path to the list of directories searched for selected files"
 				"\n  -a          Show selection interface even if utility exits with 0 status"
+				"\n  -w          Watch for changes to files, and run the utility again"
+				"\n  -r          Scan log files under directories"
+				"\n  -1          Stop at the first match, leaving the utility running"
+				"\n  -k          With -1, kill the utility instead"
+				"\n  -f          Keep reading output while selecting, adding new matches"
+				"\n  --last[=n]  Reopen the last (or nth last) session without running anything"
+				"\n  --sessions  List the cached sessions"
+				"\n  --format    Write matches to stdout as JSON lines, a quickfix list or SARIF"
+				"\n  --timing    Report the longest waits for output, and the time up to matches by file"
 				);
 			}
 			exit(1);
@@ -118,22 +231,343 @@ args(int argc, const char **argv)
 		utility[i - optind] = argv[i];
 }
 
+// Directories of files found in the git index, which path_index counts
+// on from options.paths.  The index is asked of plsd if it’s running.
+static struct {
+	gitindex_t index;
+	daemon_t daemon;
+	int remote;         // looked up by plsd
+	char cwd[PATH_MAX];
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	char** dirs;
+	int count;
+	int size;
+	int* table;         // dirs by hash, as 1 + their index, or 0 if free
+	int table_size;
+} tracked = { .once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Where a field’s path is relative to, if it was found with -p or in the
+// git index
+const char*
+field_dir(const struct field_t* field)
+{
+	if (field->path_index > options.path_count)
+		return tracked.dirs[field->path_index - options.path_count - 1];
+	return field->path_index > 0 ? options.paths[field->path_index-1] : NULL;
+}
+
+// Looks for the file a field names, if that was left until it was needed
+static void
+field_resolve(struct field_t* field)
+{
+	char buf[PATH_MAX];
+
+	if (field->path_index >= 0)
+		return;
+	field->path_index = 0;
+	resolve_field(in.v, field, buf);
+}
+
+// The slot of a directory in the table, or the free one it would go in
+static int*
+tracked_slot(const char* dir, size_t length)
+{
+	size_t i = hash_bytes(14695981039346656037u, dir, length) & (tracked.table_size-1);
+	int* slot;
+
+	for (; *(slot = &tracked.table[i]); i = (i + 1) & (tracked.table_size-1))
+		if (strncmp(tracked.dirs[*slot-1], dir, length) == 0 && tracked.dirs[*slot-1][length] == '\0')
+			break;
+
+	return slot;
+}
+
+// Adds a directory, even if it's already there, so that path_index counts
+// as it did when a session was saved.  The lock must be held.
+static int
+tracked_append(const char* dir, size_t length)
+{
+	int* slot;
+	int i;
+
+	if (tracked.count == tracked.size) {
+		tracked.size = tracked.size ? tracked.size*2 : 64;
+		tracked.dirs = realloc(tracked.dirs, tracked.size*sizeof(*tracked.dirs));
+		if (!tracked.dirs) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	tracked.dirs[tracked.count] = malloc(length + 1);
+	if (!tracked.dirs[tracked.count]) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(tracked.dirs[tracked.count], dir, length);
+	tracked.dirs[tracked.count][length] = '\0';
+	++tracked.count;
+
+	// Kept at most half full
+	if (tracked.count*2 > tracked.table_size) {
+		free(tracked.table);
+		tracked.table_size = tracked.table_size ? tracked.table_size*2 : 128;
+		tracked.table = calloc(tracked.table_size, sizeof(*tracked.table));
+		if (!tracked.table) {
+			perror("calloc");
+			exit(1);
+		}
+		for (i = 0; i < tracked.count; ++i)
+			if (!*(slot = tracked_slot(tracked.dirs[i], strlen(tracked.dirs[i]))))
+				*slot = i + 1;
+	} else if (!*(slot = tracked_slot(dir, length))) {
+		*slot = tracked.count;
+	}
+
+	return options.path_count + tracked.count;
+}
+
+// The path_index of a directory for fields to refer to, added if it's new
+int
+tracked_dir(const char* dir, size_t length)
+{
+	int* slot;
+	int n;
+
+	pthread_mutex_lock(&tracked.lock);
+	if (tracked.table_size > 0 && *(slot = tracked_slot(dir, length)))
+		n = options.path_count + *slot;
+	else
+		n = tracked_append(dir, length);
+	pthread_mutex_unlock(&tracked.lock);
+
+	return n;
+}
+
+// Forgets the directories, once no field refers to them
+static void
+tracked_reset(void)
+{
+	int i;
+
+	pthread_mutex_lock(&tracked.lock);
+	for (i = 0; i < tracked.count; ++i)
+		free(tracked.dirs[i]);
+	tracked.count = 0;
+	if (tracked.table)
+		memset(tracked.table, 0, tracked.table_size*sizeof(*tracked.table));
+	pthread_mutex_unlock(&tracked.lock);
+}
+
+static void
+tracked_load(void)
+{
+	if (getcwd(tracked.cwd, sizeof(tracked.cwd)) && daemon_connect(&tracked.daemon))
+		tracked.remote = 1;
+	else
+		gitindex_load(&tracked.index, ".");
+}
+
+// Looks up a partial path as gitindex_find does, setting root to the
+// work tree and file to a copy of one of the files matching
+static size_t
+tracked_find(const char* path, size_t length, char root[PATH_MAX], char file[PATH_MAX])
+{
+	const char* found;
+	long count = -1;
+
+	pthread_once(&tracked.once, tracked_load);
+
+	pthread_mutex_lock(&tracked.lock);
+	if (tracked.remote && (count = daemon_find(&tracked.daemon, tracked.cwd, path, length, root, file)) < 0) {
+		// Without plsd after all
+		daemon_close(&tracked.daemon);
+		tracked.remote = 0;
+		gitindex_load(&tracked.index, ".");
+	}
+	if (!tracked.remote && (count = gitindex_find(&tracked.index, path, length, &found))) {
+		snprintf(root, PATH_MAX, "%s", tracked.index.root);
+		snprintf(file, PATH_MAX, "%s", found);
+	}
+	pthread_mutex_unlock(&tracked.lock);
+
+	return count;
+}
+
+// Writes the marked fields as a quickfix list, and has vim load it
+void
+editor_quickfix(const char *vim, const struct field_t **fields, size_t n)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char errorfile[PATH_MAX], file[PATH_MAX];
+	char* argv[4] = { (char*)vim, "-q", errorfile, NULL };
+	const char *message, *end;
+	shadow_t shadow;
+	size_t i;
+	int fd;
+	FILE* out;
+
+	snprintf(errorfile, sizeof(errorfile), "%s/pls-%d.err", tmpdir ? tmpdir : "/tmp", (int)getpid());
+	unlink(errorfile);
+
+	if ((fd = open(errorfile, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0 || !(out = fdopen(fd, "w"))) {
+		perror(errorfile);
+		return;
+	}
+
+	for (i = 0; i < n; ++i)
+	{
+		// The rest of the line, as shown, is the message
+		message = in.v + fields[i]->match.stop;
+		end = strchr(message, '\n');
+		if (!end)
+			end = message + strlen(message);
+		while (message < end && (*message == ':' || *message == ' '))
+			++message;
+
+		shadow_init(&shadow);
+		ansi_strip(&shadow, message, end - message);
+
+		field_path(file, sizeof(file), in.v, fields[i], field_dir(fields[i]));
+		fprintf(out, "%s:%ld:%ld:%.*s\n", file,
+			MAX(field_number(in.v, fields[i]->line), 1),
+			field_number(in.v, fields[i]->column),
+			(int)shadow.nmemb, shadow.v);
+
+		shadow_free(&shadow);
+	}
+
+	if (ferror(out) | fclose(out))
+		perror(errorfile);
+	else
+		launch_wait(argv);
+
+	unlink(errorfile);
+}
+
+// Opens all of the marked fields in one go: vim gets a quickfix list, and
+// other editors a path, line and column for each.  Commands which need a
+// shell, and editors already running, open them one after another.
+void
+editor_marked(void)
+{
+	char template[BUFSIZ], file[PATH_MAX];
+	char* cmd = editor_command();
+	char* shell[4] = { "/bin/sh", "-c", cmd, NULL };
+	const struct field_t **fields;
+	const char **dirs;
+	char** argv;
+	wordexp_t words;
+	size_t i, n = 0;
+
+	fields = malloc(mark_count*sizeof(*fields));
+	dirs = malloc(mark_count*sizeof(*dirs));
+	if (!fields || !dirs) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < field_count; ++i)
+	{
+		if (!marks[i])
+			continue;
+		field_resolve(&field_offsets[i]);
+		fields[n] = &field_offsets[i];
+		dirs[n++] = field_dir(&field_offsets[i]);
+	}
+
+	// Last first, to leave the editor at the first one
+	for (i = n; i > 0; --i)
+	{
+		field_path(file, sizeof(file), in.v, fields[i-1], dirs[i-1]);
+		if (!launch_remote(file, field_number(in.v, fields[i-1]->line), field_number(in.v, fields[i-1]->column)))
+			break;
+	}
+
+	if (i < n) {
+		// The server took them
+	} else if (wordexp(cmd, &words, WRDE_NOCMD) == 0 && words.we_wordc > 0) {
+		(void)freopen("/dev/tty", "r", stdin);
+
+		if (is_named_executable(words.we_wordv[0], "vim") ||
+		    is_named_executable(words.we_wordv[0], "vi") ||
+		    is_named_executable(words.we_wordv[0], "nvim")) {
+			editor_quickfix(words.we_wordv[0], fields, n);
+		} else {
+			argv = format_argv_each(words.we_wordv, words.we_wordc, in.v, fields, dirs, n);
+			launch_wait(argv);
+			free_argv(argv);
+		}
+		wordfree(&words);
+	} else {
+		(void)freopen("/dev/tty", "r", stdin);
+
+		snprintf(template, sizeof(template), "%s", cmd);
+		for (i = 0; i < n; ++i)
+		{
+			snprintf(cmd, BUFSIZ, "%s", template);
+			if (!format_cmd(cmd, BUFSIZ, in.v, fields[i], dirs[i])) {
+				fprintf(stderr, "\033[1mError\033[0m: editor command too long\n");
+				break;
+			}
+			launch_wait(shell);
+		}
+	}
+
+	free(fields);
+	free(dirs);
+}
+
 void
 editor(void)
 {
 	char* cmd = editor_command();
-	const char* path = NULL;
-	const struct field_t* field = &field_offsets[selection_index];
+	const char* path;
+	const struct field_t* field;
+	char file[PATH_MAX];
+	char* shell[4] = { "/bin/sh", "-c", cmd, NULL };
+	char** argv;
+	wordexp_t words;
+	size_t i;
+
+	if (!cmd) {
+		fprintf(stderr, "\033[1mError\033[0m: editor command too long\n");
+		return;
+	}
+
+	if (mark_count > 1) {
+		editor_marked();
+		return;
+	}
 
-	if (field->path_index > 0)
-		path = options.paths[field->path_index-1];
+	for (i = 0; mark_count && i < field_count; ++i)
+		if (marks[i])
+			selection_index = i;
 
-	format_cmd(cmd, in.v, field, path);
+	field_resolve(&field_offsets[selection_index]);
+	field = &field_offsets[selection_index];
+	path = field_dir(field);
+
+	field_path(file, sizeof(file), in.v, field, path);
+	if (launch_remote(file, field_number(in.v, field->line), field_number(in.v, field->column)))
+		return;
 
 	// vim need stdin to be a tty
 	(void)freopen("/dev/tty", "r", stdin);
 
-	system(cmd);
+	// Split the command as the shell would, without running one; commands
+	// using pipes, substitutions and so on still go through the shell.
+	if (wordexp(cmd, &words, WRDE_NOCMD) == 0 && words.we_wordc > 0) {
+		argv = format_argv(words.we_wordv, words.we_wordc, in.v, field, path);
+		wordfree(&words);
+
+		launch_wait(argv);
+		free_argv(argv);
+	} else if (format_cmd(cmd, BUFSIZ, in.v, field, path)) {
+		launch_wait(shell);
+	} else {
+		fprintf(stderr, "\033[1mError\033[0m: editor command too long\n");
+	}
 }
 
 ssize_t
@@ -153,34 +587,161 @@ xwrite(int fd, const char *s, size_t nmemb)
 	return nmemb;
 }
 
+// The display rows currently on screen, laid out for the terminal size
+static struct {
+	size_t *rows;
+	size_t count;
+	unsigned int width;
+	unsigned int height;
+} view;
+
+// The source around the selected match, shown below the output with p
+static struct {
+	int shown;
+	preview_t files;
+} preview;
+
+// Writes s[from, to), underlining any marked matches
 void
-tdraw(const char *s, size_t start, size_t stop)
+twrite_marked(const char *s, size_t from, size_t to)
 {
-	static size_t output_start = 0;
-	static size_t output_stop = 0;
+	size_t lo = 0, hi = field_count, mid, a, b;
 
-	// Only move the visible region if necessary
-	if(!(start >= output_start && stop < output_stop))
+	// The first field ending after from
+	while (lo < hi)
 	{
-		size_t index = find_line_index(&in, start);
-		if(index < tty.height/2)
-			index = 0;
+		mid = lo + (hi - lo) / 2;
+		if (field_offsets[mid].match.stop <= from)
+			lo = mid + 1;
 		else
-			index -= tty.height/2;
+			hi = mid;
+	}
 
-		output_start = in.line_offsets[index];
+	for (; mark_count && lo < field_count && field_offsets[lo].match.start < to; ++lo)
+	{
+		if (!marks[lo])
+			continue;
 
-		if(index + tty.height >= in.nlines)
-			output_stop = in.nmemb;
-		else
-			output_stop = in.line_offsets[index+tty.height-1];
+		a = MAX(field_offsets[lo].match.start, from);
+		b = MIN(field_offsets[lo].match.stop, to);
+		twrite(s + from, a - from);
+		tputs(T_ENTER_UNDERLINE_MODE);
+		twrite(s + a, b - a);
+		tputs(T_RESET_SGR);
+		from = b;
+	}
+
+	twrite(s + from, to - from);
+}
+
+// Returns the number of rows drawn
+size_t
+tdraw(const char *s, size_t start, size_t stop, int marked)
+{
+	size_t output_start, output_stop, height;
+
+	if (view.width != tty.width || view.height != tty.height) {
+		view.rows = realloc(view.rows, tty.height*sizeof(*view.rows));
+		if (!view.rows) {
+			perror("realloc");
+			exit(1);
+		}
+		view.width = tty.width;
+		view.height = tty.height;
+		view.count = 0;
 	}
 
-	twrite(s+output_start, start-output_start);
+	// Only move the visible region if necessary, or to show output that’s
+	// come since, which is followed while nothing’s selected.  The preview
+	// takes the lower half of the screen.
+	height = preview.shown ? MAX((tty.height-1)/2, 1) : tty.height-1;
+	if (start == in.nmemb && options.follow)
+		view.count = input_layout_tail(&in, tty.width, height, view.rows);
+	else if(!view.count || !(start >= view.rows[0] && stop < view.rows[view.count]) ||
+			(view.count < height && view.rows[view.count] < in.nmemb))
+		view.count = input_layout(&in, start, tty.width, height, view.rows);
+
+	output_start = view.rows[0];
+	output_stop = view.rows[view.count];
+
+	twrite_marked(s, output_start, start);
 	tputs(T_ENTER_STANDOUT_MODE);
+	if (marked)
+		tputs(T_ENTER_UNDERLINE_MODE);
 	twrite(s + start, stop - start);
 	tputs(T_RESET_SGR);
-	twrite(s + stop, output_stop - stop);
+	twrite_marked(s, stop, output_stop);
+
+	// Leave the cursor at the start of the row below
+	if (output_stop > output_start && s[output_stop-1] != '\n')
+		tputs("\n");
+
+	return view.count;
+}
+
+// Draws the lines around the selected match’s line in its file, in up to
+// height rows below the output, returning the number of rows drawn
+size_t
+tpreview(size_t field_index, size_t height)
+{
+	char file[PATH_MAX], s[PATH_MAX + 32];
+	const struct field_t* field;
+	input_t* source;
+	size_t first, count, lines, i, start, stop;
+	char* next;
+	long line;
+	int n;
+
+	if (!preview.shown || height < 2 || field_index >= field_count)
+		return 0;
+
+	field = &field_offsets[field_index];
+	field_path(file, sizeof(file), in.v, field, field_dir(field));
+	line = field_number(in.v, field->line);
+
+	tputs(T_RESET_SGR);
+	n = snprintf(s, sizeof(s), "==> %s <==", file);
+	twrite(s, MIN((size_t)n, MIN(sizeof(s)-1, tty.width)));
+	tputs("\n");
+
+	if (!(source = preview_file(&preview.files, file))) {
+		tputs("(can’t be read)\n");
+		return 2;
+	}
+
+	// Lines are numbered from 1; a newline at the end doesn’t start another
+	lines = source->nlines + (input_line_offset(source, source->nlines) < source->nmemb);
+	count = MIN(height - 1, lines);
+	first = line > 1 ? (size_t)line - 1 : 0;
+	first = first > count/2 ? first - count/2 : 0;
+	if (first + count > lines)
+		first = lines - count;
+
+	for (i = first; i < first + count; ++i)
+	{
+		start = input_line_offset(source, i);
+		stop = i < source->nlines ? input_line_offset(source, i+1) - 1 : source->nmemb;
+		if (stop > start && source->v[stop-1] == '\r')
+			--stop;
+
+		// The gutter is a tab wide, so tabs in the line still line up
+		n = snprintf(s, sizeof(s), "%6zu  ", i+1);
+		if ((long)i+1 == line) {
+			tputs(T_ENTER_STANDOUT_MODE);
+			twrite(s, n);
+			tputs(T_RESET_SGR);
+		} else {
+			twrite(s, n);
+		}
+
+		// Only as much as fits on one row
+		next = find_next_line(source->v + start, source->v + stop, MAX((int)tty.width - n, 1));
+		twrite(source->v + start, (next ? (size_t)(next - source->v) : stop) - start);
+		tputs(T_RESET_SGR);
+		tputs("\n");
+	}
+
+	return 1 + count;
 }
 
 void
@@ -210,15 +771,14 @@ twrite(const char *s, size_t nmemb)
 }
 
 void
-tinfo(void)
+tsize(void)
 {
-	struct winsize ws;
+	struct winsize ws = {0};
 
-	tty.in = open("/dev/tty", O_RDONLY);
-	if (!tty.in)
-		perror("open");
-	if (ioctl(tty.in, TIOCGWINSZ, &ws) < 0) {
+	if (ioctl(tty.in, TIOCGWINSZ, &ws) < 0)
 		perror("ioctl");
+
+	if (ws.ws_row < 2 || ws.ws_col == 0) {
 		tty.height = 24;
 		tty.width = 80;
 	} else {
@@ -227,10 +787,148 @@ tinfo(void)
 	}
 }
 
+void
+tinfo(void)
+{
+	tty.in = open("/dev/tty", O_RDONLY);
+	if (!tty.in)
+		perror("open");
+	tsize();
+}
+
+#define KEY_FRAME   16667 // microseconds between frames while handling keys
+#define ESCAPE_WAIT 25000 // for the rest of an escape sequence to arrive
+
+// Keys read but not yet handled.  Whatever’s waiting is read at once, so a
+// burst of keys (from one held down over a slow connection, say) is all
+// handled before the next frame is drawn.
+static struct {
+	unsigned char v[256];
+	size_t start;
+	size_t stop;
+	struct timespec drawn;  // when the last frame was
+} keys;
+
+// Reads what’s waiting into keys, waiting up to timeout microseconds for
+// it, or with a negative timeout until there is some.  Returns 0 if none
+// came, and -1 if interrupted or the terminal’s gone.
+static int
+keys_read(long timeout)
+{
+	struct timeval tv = { timeout / 1000000, timeout % 1000000 };
+	fd_set fds;
+	ssize_t n;
+
+	if (keys.start > 0) {
+		memmove(keys.v, keys.v + keys.start, keys.stop - keys.start);
+		keys.stop -= keys.start;
+		keys.start = 0;
+	}
+	if (keys.stop == sizeof(keys.v))
+		return 0;
+
+	errno = 0;
+	FD_ZERO(&fds);
+	FD_SET(tty.in, &fds);
+	if ((n = select(tty.in+1, &fds, NULL, NULL, timeout < 0 ? NULL : &tv)) <= 0)
+		return n;
+
+	n = read(tty.in, keys.v + keys.stop, sizeof(keys.v) - keys.stop);
+	if (n <= 0)
+		return -1;
+	keys.stop += n;
+
+	return 1;
+}
+
+// Whether there are keys to handle before drawing, waiting until the next
+// frame is due for more to arrive
+static int
+keys_pending(void)
+{
+	struct timespec now;
+	long wait;
+
+	if (keys.start < keys.stop)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait = KEY_FRAME - ((now.tv_sec - keys.drawn.tv_sec)*1000000L + (now.tv_nsec - keys.drawn.tv_nsec)/1000);
+
+	return wait > 0 && keys_read(wait) > 0;
+}
+
+// The next key, decoding escape sequences: CSI(c) for ESC [ ... c and
+// ESC O c, and ESCAPE for escape on its own or with another key.
+// Returns -1 if interrupted, or the terminal’s gone.
+static int
+read_key(void)
+{
+	size_t i;
+	int c;
+
+	while (keys.start == keys.stop)
+		if (keys_read(-1) < 0)
+			return -1;
+
+	if (keys.v[keys.start] != ESCAPE)
+		return keys.v[keys.start++];
+
+	// The rest of a sequence may come a little later
+	for (i = keys.start + 1; ; ++i)
+	{
+		if (i == keys.stop) {
+			i -= keys.start;
+			if (keys_read(ESCAPE_WAIT) <= 0)
+				break;
+			i += keys.start;
+		}
+
+		c = keys.v[i];
+		if (i == keys.start + 1 && c != '[' && c != 'O') {
+			keys.start = i + 1;
+			return ESCAPE;
+		}
+		if (i > keys.start + 1 && (keys.v[keys.start+1] == 'O' || (c >= 0x40 && c <= 0x7e))) {
+			// ESC [ 1 ~ and the like for home and end
+			if (c == '~' && i == keys.start + 3) {
+				c = keys.v[i-1];
+				c = c == '1' || c == '7' ? HOME : c == '4' || c == '8' ? END : 0;
+			}
+			keys.start = i + 1;
+			return c ? CSI(c) : 0;
+		}
+	}
+
+	// Escape on its own, or a sequence cut short
+	c = keys.stop - keys.start == 1 ? ESCAPE : 0;
+	keys.start = keys.stop;
+	return c;
+}
+
+static volatile sig_atomic_t resized = 0;
+
+void
+sigwinch(int sig)
+{
+	(void)sig;
+	resized = 1;
+}
+
 void
 tsetup(void)
 {
 	struct termios attr;
+	struct sigaction sa;
+
+	// Without SA_RESTART, so a resize interrupts waiting for a key
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigwinch;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH, &sa, NULL);
+
+	// Keys left from before editing were meant for the editor
+	keys.start = keys.stop = 0;
 
 	tcgetattr(tty.in, &tty.attr);
 	memcpy(&attr, &tty.attr, sizeof(struct termios));
@@ -257,6 +955,42 @@ tend(void)
 	close(tty.out);
 }
 
+#define FOLLOW_FRAME 33333 // microseconds between updates of the list with -f
+
+// With -f, output keeps being read while selecting, and what’s come since
+// is matched and added to the list a frame at a time
+static struct {
+	int fds[PIPES];     // being read from, or -1
+	pid_t pid;          // the utility, if one was run
+	size_t studied;     // output matched so far, in whole lines
+	int pending;        // output read since the last update
+	struct timespec frame;
+} follow = { { -1, -1 }, 0, 0, 0, { 0, 0 } };
+
+// Whether output is still being followed
+static int
+following(void)
+{
+	return follow.fds[0] >= 0 || follow.fds[1] >= 0;
+}
+
+// How long until the list is due to be updated
+static struct timeval*
+follow_timeout(struct timeval *timeout)
+{
+	struct timespec now;
+	long wait;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait = FOLLOW_FRAME - ((now.tv_sec - follow.frame.tv_sec)*1000000L + (now.tv_nsec - follow.frame.tv_nsec)/1000);
+	if (wait < 0)
+		wait = 0;
+	timeout->tv_sec = wait / 1000000;
+	timeout->tv_usec = wait % 1000000;
+
+	return timeout;
+}
+
 enum
 {
 	none,
@@ -264,32 +998,136 @@ enum
 	quit,
 	prev, next,
 	first, last,
+	search,
+	resize,
+	rerun,
+	more,
+	finished,
+	toggle_mark, mark_all,
+	toggle_preview,
+	toggle_new,
+	// filter prompt commands
+	input, erase, clear, accept, cancel,
+	toggle_scope, toggle_fuzzy,
 }
-read_command ()
+read_command (int prompt, char* ch)
 {
-	char c[3];
+	int c;
 
-	if (read(tty.in, &c, 3) < 0)
-		perror("read");
+	if (resized) {
+		resized = 0;
+		return resize;
+	}
 
-	if (c[0] == ESCAPE) {
-		if (c[1] != '[')
-			return none;
+	// A rerun is over once all its output has been matched
+	if (options.watch && follow.pid > 0 && !following() && !follow.pending)
+		return rerun_finish() ? rerun : finished;
+
+	// In watch mode, changes to files interrupt waiting for a key, and in
+	// follow mode so does new output, once the next update is due
+	while ((watch_fd >= 0 || following() || follow.pending) && keys.start == keys.stop) {
+		struct timeval timeout;
+		fd_set fds;
+		int n, max_fd = tty.in;
+
+		FD_ZERO(&fds);
+		FD_SET(tty.in, &fds);
+		if (watch_fd >= 0) {
+			FD_SET(watch_fd, &fds);
+			max_fd = MAX(max_fd, watch_fd);
+		}
+		for (n = 0; n < PIPES; ++n) {
+			if (follow.fds[n] >= 0) {
+				FD_SET(follow.fds[n], &fds);
+				max_fd = MAX(max_fd, follow.fds[n]);
+			}
+		}
 
-		switch (c[2]) {
-		case 'Z': /* ESC[Z = shift-tab */
-		case UP_ARROW:
-		case LEFT_ARROW:
-			return prev;
-		case DOWN_ARROW:
-		case RIGHT_ARROW:
+		n = select(max_fd+1, &fds, NULL, NULL, follow.pending ? follow_timeout(&timeout) : NULL);
+		if (n < 0) {
+			if (errno == EINTR && resized) {
+				resized = 0;
+				return resize;
+			}
+			if (errno == EINTR)
+				continue;
+			perror("select");
+			break;
+		}
+
+		if (FD_ISSET(tty.in, &fds))
+			break;
+
+		// Changes while the utility reruns are sorted out once it’s done,
+		// from what it writes itself
+		if (watch_fd >= 0 && FD_ISSET(watch_fd, &fds)) {
+			if (follow.pid > 0) {
+				watch_record(watch_fd);
+			} else if (watch_changed(watch_fd)) {
+				watch_settle(watch_fd);
+				return rerun;
+			}
+		}
+
+		if (follow_read(&fds))
+			return more;
+	}
+
+	if ((c = read_key()) < 0) {
+		if (resized) {
+			resized = 0;
+			return resize;
+		}
+		return errno == EINTR ? none : quit;
+	}
+
+	switch (c) {
+	case ESCAPE:
+		return prompt ? cancel : none;
+	case CSI('Z'): /* ESC[Z = shift-tab */
+	case CSI(UP_ARROW):
+	case CSI(LEFT_ARROW):
+		return prev;
+	case CSI(DOWN_ARROW):
+	case CSI(RIGHT_ARROW):
+		return next;
+	case CSI(HOME):
+		return first;
+	case CSI(END):
+		return last;
+	}
+	if (c > 255)
+		return none;
+
+	if (prompt) {
+		switch (c) {
+		case '\n':
+			return accept;
+		case CONTROL('C'):
+			return cancel;
+		case BACKSPACE:
+		case CONTROL('H'):
+			return erase;
+		case CONTROL('U'):
+			return clear;
+		case '\t':
+			return toggle_scope;
+		case CONTROL('F'):
+			return toggle_fuzzy;
+		case CONTROL('N'):
 			return next;
-		default:
-			return none;
+		case CONTROL('P'):
+			return prev;
+		}
+
+		if (c >= ' ') {
+			*ch = c;
+			return input;
 		}
+		return none;
 	}
 
-	switch (c[0]) {
+	switch (c) {
 	case '\n':
 		return edit;
 	case CONTROL('C'):
@@ -307,81 +1145,673 @@ read_command ()
 		return first;
 	case CONTROL('E'):
 		return last;
+	case '/':
+		return search;
+	case ' ':
+		return toggle_mark;
+	case '*':
+		return mark_all;
+	case 'p':
+		return toggle_preview;
+	case 'n':
+		return toggle_new;
+	case 'r':
+		if (watch_fd >= 0)
+			return rerun;
+		break;
 	}
 
 	return none;
 }
 
+// Filtering state for the selection interface.
+// Results index into field_offsets; the line filter is only built on first use.
+static struct {
+	filter_t path;
+	filter_t line;
+	filter_t* active;
+	int prompt;         // the query is being edited
+	char query[MAX_QUERY];
+	size_t query_length;
+} filter;
+
 void
-tmain(void)
+filter_build_line (void)
 {
-	size_t start, stop;
-	size_t field_index;
+	size_t i, start, stop;
 
-	start = stop = 0;
+	for (i = filter.line.count; i < field_count; ++i)
+	{
+		start = field_offsets[i].match.start;
+		stop = field_offsets[i].match.stop;
 
-	if(options.initial_last)
-		field_index = field_count-1;
-	else
-		field_index = 0;
+		while (start > 0 && in.v[start-1] != '\n')
+			--start;
+		while (stop < in.nmemb && in.v[stop] != '\n')
+			++stop;
 
-	for (;;) {
-		start = field_offsets[field_index].match.start;
-		stop = field_offsets[field_index].match.stop;
+		filter_add(&filter.line, in.v + start, stop - start);
+	}
+}
+
+// Indexes the fields, keeping the scope of any earlier filter
+void
+filter_setup (void)
+{
+	int line = filter.active == &filter.line;
+	size_t i;
+
+	filter_free(&filter.path);
+	filter_free(&filter.line);
+
+	for (i = 0; i < field_count; ++i)
+		filter_add(&filter.path, in.v + field_offsets[i].path.start,
+		           field_offsets[i].path.stop - field_offsets[i].path.start);
+
+	filter.active = &filter.path;
+	if (line) {
+		filter_build_line();
+		filter.active = &filter.line;
+	}
+}
+
+// Leaves only the new fields in the results, when only those are listed
+void
+filter_narrow (void)
+{
+	size_t i, n;
+
+	if (!diff.only)
+		return;
+
+	for (i = n = 0; i < filter.active->nresults; ++i)
+		if (diff.fresh[filter.active->results[i]])
+			filter.active->results[n++] = filter.active->results[i];
+	filter.active->nresults = n;
+}
+
+void
+tstatus(size_t field_index)
+{
+	char s[MAX_QUERY + 96];
+	size_t n = 0;
+	long ms;
+
+	if (mark_count)
+		n += snprintf(s, sizeof(s), "[%zu marked] ", mark_count);
+
+	if (diff.fresh)
+		n += snprintf(s + n, sizeof(s) - n, "[%s%zu new] ", diff.only ? "" : "all, ", diff.count);
+
+	if (filter.prompt || filter.query_length > 0) {
+		n += snprintf(s + n, sizeof(s) - n, "%s%s/%.*s (%zu/%zu)",
+			filter.active == &filter.line ? "[line] " : "",
+			filter.active->fuzzy ? "[fuzzy] " : "",
+			(int)filter.query_length, filter.query,
+			filter.active->nresults, field_count);
+	} else if (options.watch) {
+		n += snprintf(s + n, sizeof(s) - n, "%s %zu match%s",
+			follow.pid > 0 ? "[running]" : "[watching]",
+			field_count, field_count == 1 ? "" : "es");
+	} else if (options.follow) {
+		n += snprintf(s + n, sizeof(s) - n, "%s%zu match%s",
+			following() ? "[following] " : "",
+			field_count, field_count == 1 ? "" : "es");
+	}
+
+	// When the match arrived, for output read as it ran
+	if (field_index < field_count && in.timed && !options.scan &&
+			(ms = input_line_time(&in, find_line_index(&in, field_offsets[field_index].match.start))) >= 0) {
+		n += snprintf(s + n, sizeof(s) - n, "%s[+%.1fs]",
+			n && s[n-1] != ' ' ? " " : "", ms / 1000.0);
+	}
+
+	if (field_index < field_count && diff.fresh && !diff.only && diff.fresh[field_index]) {
+		n += snprintf(s + n, sizeof(s) - n, "%s[new]", n && s[n-1] != ' ' ? " " : "");
+	}
+
+	if (field_index < field_count && field_offsets[field_index].ambiguous > 1) {
+		n += snprintf(s + n, sizeof(s) - n, "%s[%d tracked files match]",
+			n && s[n-1] != ' ' ? " " : "", field_offsets[field_index].ambiguous);
+	}
+
+	if (n == 0)
+		return;
+
+	tputs(T_RESET_SGR);
+	twrite(s, MIN(n, sizeof(s)-1));
+}
 
-		tdraw(in.v, start, stop);
+// Clears the marks, for a new set of fields
+void
+marks_reset(void)
+{
+	free(marks);
+	marks = calloc(field_count + 1, sizeof(*marks));
+	if (!marks) {
+		perror("calloc");
+		exit(1);
+	}
+	mark_count = 0;
+}
+
+// Leaves only the output on screen, with the cursor below it
+void
+tpreview_clear(size_t rows)
+{
+	if (!rows)
+		return;
+	tprintf(T_CURSOR_UP, rows);
+	tprintf(T_COLUMN_ADDRESS, 1);
+	tputs(T_ERASE_DOWN);
+	tputs(T_RESET_SGR);
+}
+
+void
+tmain(void)
+{
+	size_t start, stop;
+	size_t field_index;
+	size_t rows, preview_rows;
+	size_t pos; // position in the filter results
+	size_t i, j;
+	int refilter, at_last;
+	char ch = 0;
+
+	start = stop = 0;
+	rows = preview_rows = 0;
+
+	filter_setup();
+	filter_narrow();
+	marks_reset();
+
+	if(options.initial_last && filter.active->nresults > 0)
+		pos = filter.active->nresults-1;
+	else
+		pos = 0;
+
+	for (;;) {
+		if (pos >= filter.active->nresults)
+			pos = 0;
+
+		if (filter.active->nresults > 0) {
+			field_index = filter.active->results[pos];
+			field_resolve(&field_offsets[field_index]);
+			start = field_offsets[field_index].match.start;
+			stop = field_offsets[field_index].match.stop;
+		} else if (options.follow && filter.query_length == 0) {
+			// Nothing’s matched yet: show the latest output
+			field_index = field_count;
+			start = stop = in.nmemb;
+		} else {
+			// Nothing matches: keep the view, without a highlight
+			field_index = field_count;
+			stop = start;
+		}
 
-		switch (read_command()) {
+		// Keys waiting are handled first, so that a burst of them is drawn
+		// once, with the selection where they leave it
+		if (!keys_pending()) {
+			if (rows)
+				tprintf(T_CURSOR_UP, rows);
+			tprintf(T_COLUMN_ADDRESS, 1);
+			tputs(T_ERASE_DOWN);
+			tputs(T_RESET_SGR);
+
+			rows = tdraw(in.v, start, stop, field_index < field_count && marks[field_index]);
+			preview_rows = tpreview(field_index, tty.height-1 - rows);
+			rows += preview_rows;
+			tstatus(field_index);
+			clock_gettime(CLOCK_MONOTONIC, &keys.drawn);
+		}
+
+		refilter = 1;
+		switch (read_command(filter.prompt, &ch)) {
 		case edit:
+			if (field_index == field_count && !mark_count) {
+				refilter = 0;
+				break;
+			}
 			selection_index = field_index;
+			tpreview_clear(preview_rows);
 			return;
 		case quit:
+			tpreview_clear(preview_rows);
 			return;
+		case toggle_preview:
+			preview.shown = !preview.shown;
+			view.count = 0;
+			refilter = 0;
+			break;
+		case toggle_new:
+			if (!diff.fresh || diff.count == 0) {
+				refilter = 0;
+				break;
+			}
+			// Fields dropped from the results can’t come back by narrowing
+			diff.only = !diff.only;
+			filter_invalidate(filter.active);
+			pos = 0;
+			break;
 		case first:
-			field_index = 0;
+			pos = 0;
+			refilter = 0;
 			break;
 		case next:
-			if (++field_index == field_count)
-				field_index = 0;
+			if (++pos >= filter.active->nresults)
+				pos = 0;
+			refilter = 0;
 			break;
 		case last:
-			field_index = field_count-1;
+			pos = filter.active->nresults ? filter.active->nresults-1 : 0;
+			refilter = 0;
 			break;
 		case prev:
-			if(field_index == 0)
-				field_index = field_count-1;
+			if(pos == 0)
+				pos = filter.active->nresults ? filter.active->nresults-1 : 0;
 			else
-				--field_index;
+				--pos;
+			refilter = 0;
 			break;
-		case none:
+		case toggle_mark:
+			if (field_index < field_count) {
+				marks[field_index] = !marks[field_index];
+				if (marks[field_index])
+					++mark_count;
+				else
+					--mark_count;
+				if (++pos >= filter.active->nresults)
+					pos = 0;
+			}
+			refilter = 0;
+			break;
+		case mark_all:
+			// Everything listed, or nothing if that’s all marked already
+			for (i = 0; i < filter.active->nresults; ++i)
+				if (!marks[filter.active->results[i]])
+					break;
+			for (j = 0; j < filter.active->nresults; ++j)
+			{
+				field_index = filter.active->results[j];
+				if (marks[field_index] == (i == filter.active->nresults))
+					mark_count += marks[field_index] ? -1 : 1;
+				marks[field_index] = i < filter.active->nresults;
+			}
+			refilter = 0;
+			break;
+		case search:
+			filter.prompt = 1;
+			break;
+		case input:
+			if (filter.query_length < MAX_QUERY-1)
+				filter.query[filter.query_length++] = ch;
+			pos = 0;
+			break;
+		case erase:
+			if (filter.query_length > 0)
+				--filter.query_length;
+			pos = 0;
+			break;
+		case clear:
+			filter.query_length = 0;
+			pos = 0;
+			break;
+		case accept:
+			filter.prompt = 0;
+			break;
+		case cancel:
+			filter.prompt = 0;
+			filter.query_length = 0;
+			pos = 0;
+			break;
+		case toggle_scope:
+			if (filter.active == &filter.path) {
+				filter_build_line();
+				filter.active = &filter.line;
+			} else {
+				filter.active = &filter.path;
+			}
+			filter_invalidate(filter.active);
+			pos = 0;
+			break;
+		case toggle_fuzzy:
+			filter.path.fuzzy = filter.line.fuzzy = !filter.active->fuzzy;
+			pos = 0;
+			break;
+		case rerun:
+			rerun_start();
+			filter_setup();
+			filter_narrow();
+			marks_reset();
+			view.count = 0;
+			start = pos = 0;
+			break;
+		case more:
+			// With -l, the selection keeps to the latest match
+			at_last = pos + 1 >= filter.active->nresults;
+			follow_update();
+			if (options.initial_last && at_last && filter.active->nresults > 0)
+				pos = filter.active->nresults-1;
+			refilter = 0;
+			break;
+		case finished:
+			// Only the new matches may be listed now
+			if (diff.only)
+				pos = 0;
+			break;
+		case resize:
+			// Only the rows on screen are laid out again, for the new size.
+			// The terminal may have reflowed what we drew, so start afresh.
+			tsize();
+			tputs(T_CURSOR_HOME);
+			tputs(T_ERASE_DOWN);
+			rows = 0;
 			continue;
+		case none:
+			refilter = 0;
+			break;
 		}
 
-		if (in.nlines)
-			tprintf(T_CURSOR_UP, in.nlines);
-		tprintf(T_COLUMN_ADDRESS, 1);
-		tputs(T_ERASE_DOWN);
-		tputs(T_RESET_SGR);
+		if (refilter) {
+			filter_update(filter.active, filter.query, filter.query_length);
+			filter_narrow();
+		}
 	}
 }
 
-#define PIPES 2
+#define ECHO_FRAME 33333      // microseconds between frames of throttled output
+#define ECHO_BURST (64*1024)  // bytes in a frame beyond which output is throttled
+#define ECHO_PENDING (16*1024) // bytes the terminal can fall behind before it is
 
-int
-run_utility (void)
+// Output is echoed as it comes until there’s more than the terminal can
+// keep up with.  Then only the latest screenful is drawn, a frame at a
+// time, so that reading (and the utility) never waits on the terminal.
+static struct {
+	int active;
+	size_t written;     // bytes echoed as they came
+	size_t burst;       // bytes read since the frame started
+	size_t drawn;       // bytes read by the last frame
+	size_t rows;        // rows of output in the last frame
+	input_mark_t mark;  // where the last frame started
+	struct timespec frame;
+	char *pending;      // for the terminal, which hasn’t taken it yet
+	size_t npending;
+	size_t pending_size;
+	int fd;             // the terminal, opened again to write without waiting
+	int opened;
+} throttle;
+
+static long
+echo_elapsed(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - throttle.frame.tv_sec)*1000000L + (now.tv_nsec - throttle.frame.tv_nsec)/1000;
+}
+
+// How long until the next frame is due
+static struct timeval*
+echo_timeout(struct timeval *timeout)
+{
+	long wait = ECHO_FRAME - echo_elapsed();
+
+	if (wait < 0)
+		wait = 0;
+	timeout->tv_sec = wait / 1000000;
+	timeout->tv_usec = wait % 1000000;
+
+	return timeout;
+}
+
+// Adds to what’s to be written to the terminal
+static void
+echo_queue(const char *s, size_t n)
+{
+	if (throttle.pending_size - throttle.npending < n) {
+		while (throttle.pending_size - throttle.npending < n)
+			throttle.pending_size = throttle.pending_size ? throttle.pending_size*2 : ECHO_PENDING;
+		throttle.pending = realloc(throttle.pending, throttle.pending_size);
+		if (!throttle.pending) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(throttle.pending + throttle.npending, s, n);
+	throttle.npending += n;
+}
+
+// Writes what’s queued as far as the terminal takes it without waiting,
+// or with wait set, all of it.  Returns whether it’s all been written.
+static int
+echo_flush(int wait)
+{
+	const char *name;
+	size_t sent = 0;
+	ssize_t n;
+
+	// Opened again rather than setting O_NONBLOCK on stdout, which the
+	// utility may share through the terminal
+	if (!throttle.opened) {
+		throttle.opened = 1;
+		name = ttyname(STDOUT_FILENO);
+		throttle.fd = name ? open(name, O_WRONLY | O_NONBLOCK | O_NOCTTY) : -1;
+	}
+
+	// Anything printed before goes first
+	fflush(stdout);
+
+	while (!wait && throttle.fd >= 0 && sent < throttle.npending &&
+	       (n = write(throttle.fd, throttle.pending + sent, throttle.npending - sent)) > 0)
+		sent += n;
+	if (wait || throttle.fd < 0) {
+		fwrite(throttle.pending + sent, 1, throttle.npending - sent, stdout);
+		fflush(stdout);
+		sent = throttle.npending;
+	}
+
+	throttle.npending -= sent;
+	memmove(throttle.pending, throttle.pending + sent, throttle.npending);
+
+	return throttle.npending == 0;
+}
+
+// Queues the end of the output to be drawn over the last frame, with a
+// counter below unless this is the last frame
+static void
+echo_frame(int counter)
+{
+	char s[128];
+	size_t start, rows;
+	int n;
+
+	n = throttle.rows ? snprintf(s, sizeof(s), "\r" T_CURSOR_UP T_ERASE_DOWN, (int)throttle.rows)
+	                  : snprintf(s, sizeof(s), "\r" T_ERASE_DOWN);
+	echo_queue(s, n);
+
+	// Rows of output to show, counting an unterminated last line
+	start = input_tail_mark(&in, tty.width, tty.height-2, &throttle.mark, &rows);
+	echo_queue(in.v + start, in.nmemb - start);
+	throttle.rows = rows;
+
+	if (counter) {
+		if (in.v[in.nmemb-1] != '\n')
+			echo_queue("\n", 1);
+		n = snprintf(s, sizeof(s), "%s %.1f MB, %zu lines so far %s",
+			T_ENTER_STANDOUT_MODE, in.nmemb / (1024.0*1024.0), in.nlines, T_RESET_SGR);
+		echo_queue(s, MIN((size_t)n, sizeof(s)-1));
+	}
+}
+
+// Echoes what’s been read, or at the end with done set, the last of it
+static void
+echo_output(int done)
+{
+	long elapsed = echo_elapsed();
+	int finished = done;
+
+	if (!throttle.active) {
+		if (elapsed >= ECHO_FRAME) {
+			clock_gettime(CLOCK_MONOTONIC, &throttle.frame);
+			throttle.burst = 0;
+		}
+		throttle.burst += in.nmemb - throttle.written;
+
+		// The terminal is written to without waiting, and can fall behind
+		// by ECHO_PENDING before it’s only given frames
+		if (throttle.burst <= ECHO_BURST) {
+			echo_queue(in.v + throttle.written, in.nmemb - throttle.written);
+			throttle.written = in.nmemb;
+			if (echo_flush(done) || throttle.npending <= ECHO_PENDING)
+				return;
+		}
+
+		throttle.active = 1;
+		throttle.rows = 0;
+		throttle.drawn = throttle.written;
+		memset(&throttle.mark, 0, sizeof(throttle.mark));
+	}
+
+	if (!done && elapsed < ECHO_FRAME)
+		return;
+
+	// A frame waits until the terminal has taken what came before
+	if (!echo_flush(done)) {
+		clock_gettime(CLOCK_MONOTONIC, &throttle.frame);
+		return;
+	}
+
+	// Once the output slows down, go back to echoing it as it comes
+	if (in.nmemb - throttle.drawn < ECHO_BURST)
+		done = 1;
+
+	if (in.nmemb > 0)
+		echo_frame(!done);
+	echo_flush(finished);
+
+	clock_gettime(CLOCK_MONOTONIC, &throttle.frame);
+	throttle.drawn = in.nmemb;
+
+	if (done) {
+		throttle.active = 0;
+		throttle.written = in.nmemb;
+		throttle.burst = 0;
+	}
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+void
+sigint(int sig)
+{
+	(void)sig;
+	interrupted = 1;
+}
+
+// While reading output, Ctrl-C stops reading and goes on to what was read,
+// rather than killing pls
+static void
+catch_interrupt(int on)
+{
+	static struct sigaction saved;
+	struct sigaction sa;
+
+	if (on) {
+		interrupted = 0;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = sigint;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, &saved);
+	} else {
+		sigaction(SIGINT, &saved, NULL);
+	}
+}
+
+// A utility left to finish with -1, to be reaped once it has
+static pid_t drained = 0;
+
+// Reads and drops the rest of the utility’s output from a process of its
+// own, in the utility’s group, so that it can carry on without blocking.
+// That process is forked twice over, so as not to be left a zombie.
+static void
+drain(pid_t group, int filedes[PIPES])
+{
+	char buf[BUFSIZ];
+	fd_set fds;
+	pid_t pid;
+	int n, reading;
+
+	if ((pid = fork()) != 0) {
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+		return;
+	}
+	if (fork() != 0)
+		_exit(0);
+	setpgid(0, group);
+
+	for (;;) {
+		FD_ZERO(&fds);
+		for (n = reading = 0; n < PIPES; ++n) {
+			if (filedes[n] != 0) {
+				FD_SET(filedes[n], &fds);
+				reading = 1;
+			}
+		}
+		if (!reading || (select(FD_SETSIZE, &fds, NULL, NULL, NULL) < 0 && errno != EINTR))
+			break;
+
+		for (n = 0; n < PIPES; ++n) {
+			if (filedes[n] != 0 && FD_ISSET(filedes[n], &fds) && read(filedes[n], buf, sizeof(buf)) <= 0)
+				filedes[n] = 0;
+		}
+	}
+
+	_exit(0);
+}
+
+// Makes group the terminal’s foreground group, returning 0 if it isn’t
+// ours to give.  Background groups are stopped for changing it, unless
+// they ignore SIGTTOU as this does.
+static int
+hand_terminal(pid_t group)
+{
+	void (*saved)(int);
+	int ok;
+
+	if (!isatty(STDIN_FILENO))
+		return 0;
+
+	saved = signal(SIGTTOU, SIG_IGN);
+	ok = tcsetpgrp(STDIN_FILENO, group) == 0;
+	signal(SIGTTOU, saved);
+
+	return ok;
+}
+
+// Whether pls gave the utility the terminal, to take it back after
+static int utility_terminal = 0;
+
+// Starts the utility in a process group of its own, so that everything it
+// starts can be signalled, with its output and errors read from fds.
+// With terminal, and pls in the foreground, the utility is given the
+// terminal while it runs as a shell would, so that it can read from it
+// (prompts for passwords, say) without being stopped; otherwise it reads
+// from /dev/null, as while the list is shown.
+pid_t
+spawn_utility(int fds[PIPES], int terminal)
 {
 	pid_t pid;
-	int status;
 	int filedes[PIPES][2];
 	int n;
-	int max_fd;
-	fd_set out_fds;
 
 	if(pipe(filedes[0]) == -1 || pipe(filedes[1]) == -1) {
 		perror("pipe");
 		exit(1);
 	}
 
+	terminal = terminal && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+
 	pid = fork();
 	if(pid == -1) {
 		perror("fork");
@@ -391,6 +1821,17 @@ run_utility (void)
 	if (pid == 0) {
 		char* const* argv = (char * const*)utility;
 
+		setpgid(0, 0);
+		signal(SIGINT, SIG_DFL);
+
+		// Given from both sides too, before the utility can read
+		if (terminal) {
+			hand_terminal(getpid());
+		} else if ((n = open("/dev/null", O_RDONLY)) >= 0) {
+			dup2(n, STDIN_FILENO);
+			close(n);
+		}
+
 		dup2(filedes[0][1], STDOUT_FILENO);
 		dup2(filedes[1][1], STDERR_FILENO);
 
@@ -404,48 +1845,117 @@ run_utility (void)
 		exit(1);
 	}
 
-	close(filedes[0][1]);
-	close(filedes[1][1]);
+	// Set from both sides, whichever runs first
+	setpgid(pid, pid);
+	utility_terminal = terminal && hand_terminal(pid);
+
+	for (n = 0; n < PIPES; ++n) {
+		close(filedes[n][1]);
+		fds[n] = filedes[n][0];
+	}
+
+	return pid;
+}
+
+// Returns the utility’s wait status, or -1 if it was left running
+int
+run_utility (int echo)
+{
+	pid_t pid;
+	int status;
+	int filedes[PIPES];
+	int n;
+	int max_fd;
+	int more;
+	fd_set out_fds;
+	struct timeval timeout;
+	size_t checked = 0;
+	int stopped = 0;
+
+	catch_interrupt(1);
+	pid = spawn_utility(filedes, 1);
 
-	while(1)
+	while(!(stopped = stop_early(&checked)))
 	{
 		FD_ZERO(&out_fds);
 		max_fd = 0;
 
 		for(n = 0; n < PIPES; ++n) {
-			if(filedes[n][0] != 0) {
-				FD_SET(filedes[n][0], &out_fds);
-				if(filedes[n][0] > max_fd)
-					max_fd = filedes[n][0];
+			if(filedes[n] != 0) {
+				FD_SET(filedes[n], &out_fds);
+				if(filedes[n] > max_fd)
+					max_fd = filedes[n];
 			}
 		}
 		if(max_fd == 0)
 			break;
 
-		int count = select(FD_SETSIZE, &out_fds, NULL, NULL, NULL);
+		// While output is throttled, wake up in time to draw the next frame,
+		// and while the terminal’s behind, to give it the rest
+		int count = select(FD_SETSIZE, &out_fds, NULL, NULL,
+		                   echo && (throttle.active || throttle.npending) ? echo_timeout(&timeout) : NULL);
+		if(count == -1 && errno == EINTR)
+			continue;
 		if(count == -1) {
 			perror("select");
 			exit(1);
 		}
+		if (count == 0)
+			echo_output(0);
 		if (count > 0)
 		{
 			for(n = 0; n < PIPES; ++n)
 			{
-				if(FD_ISSET(filedes[n][0], &out_fds))
+				if(FD_ISSET(filedes[n], &out_fds))
 				{
-					if(0 == input_read(&in, filedes[n][0], tty.width, 1)) {
-						close(filedes[n][0]);
-						filedes[n][0] = 0;
+					if (options.format)
+						more = stream_read(filedes[n]);
+					else
+						more = input_read(&in, filedes[n]);
+
+					if (echo)
+						echo_output(0);
+
+					if(!more) {
+						close(filedes[n]);
+						filedes[n] = 0;
 					}
 				}
 			}
 		}
 	}
 
-	waitpid(pid, &status, 0);
+	if (echo)
+		echo_output(1);
+
+	// Ctrl-C went to the utility while it had the terminal
+	if (utility_terminal) {
+		hand_terminal(getpgrp());
+		utility_terminal = 0;
+	}
+	catch_interrupt(0);
+
+	// Ctrl-C only reaches pls rather than the utility when it didn’t have
+	// the terminal: with stdin redirected, say, or for --format
+	status = -1;
+	if (stopped && interrupted) {
+		kill(-pid, SIGINT);
+	} else if (stopped && options.kill_utility) {
+		kill(-pid, SIGTERM);
+	} else if (stopped) {
+		drain(pid, filedes);
+		drained = pid;
+		pid = 0;
+	}
+
+	for(n = 0; n < PIPES; ++n) {
+		if (filedes[n] != 0)
+			close(filedes[n]);
+	}
 
-	// TODO: there is more to check here than > 0,
-	// `man 3 wait` for details.
+	// After Ctrl-C, whatever the utility does next isn’t waited for
+	if (pid && waitpid(pid, &status, stopped && interrupted ? WNOHANG : 0) <= 0)
+		status = -1;
 
 	return status;
 }
@@ -492,26 +2002,65 @@ exists (const char* path, size_t len)
 	return 0 == access(buf, F_OK);
 }
 
-int valid_field (const char* s, struct field_t* field)
+// Looks for a partial path among the files git tracks, which are read the
+// first time one is needed.  A path which could be several of them is
+// left for the user to tell apart.
+int
+resolve_tracked(struct field_t* field, const char* path, int length, char buf[PATH_MAX])
 {
-	if (!options.only_existing)
+	char root[PATH_MAX], file[PATH_MAX];
+	size_t count, prefix;
+	int i, n;
+
+	if (!(count = tracked_find(path, length, root, file)))
+		return 0;
+
+	if (count > 1) {
+		field->ambiguous = count;
+		snprintf(buf, PATH_MAX, "%.*s", length, path);
 		return 1;
+	}
 
+	// The file ends with the components of the path, and what comes
+	// before them is the directory it’s in
+	prefix = strlen(file);
+	for (i = 0; i < length; ++i)
+		if (path[i] != '/' && (i == 0 || path[i-1] == '/') && !(path[i] == '.' && (i+1 == length || path[i+1] == '/')))
+			while (prefix > 0 && file[--prefix] != '/')
+				;
+
+	if (strcmp(root, ".") != 0 && prefix > 0)
+		n = snprintf(buf, PATH_MAX, "%s/%.*s", root, (int)prefix, file);
+	else if (strcmp(root, ".") != 0)
+		n = snprintf(buf, PATH_MAX, "%s", root);
+	else
+		n = snprintf(buf, PATH_MAX, "%.*s", (int)MAX(prefix, 1), prefix > 0 ? file : ".");
+
+	if (n < 0 || n >= PATH_MAX)
+		return 0;
+
+	field->path_index = tracked_dir(buf, n);
+	snprintf(buf + n, PATH_MAX - n, "/%.*s", length, path);
+
+	return 1;
+}
+
+// Finds the file a field names, in the working directory or else one of the
+// search paths (noting which in path_index), and writes where it was found
+static int
+resolve_field (const char* s, struct field_t* field, char buf[PATH_MAX])
+{
 	const char* path = s+field->path.start;
-	size_t length = field->path.stop-field->path.start;
-	char buf[PATH_MAX] = {0};
+	int length = field->path.stop-field->path.start;
 	int n;
 
-	strncpy(buf, path, length);
-
+	snprintf(buf, PATH_MAX, "%.*s", length, path);
 	if(0 == access(buf, F_OK))
 		return 1;
 
 	for (n = 0; n < options.path_count; ++n)
 	{
-		strcpy(buf, options.paths[n]);
-		strcat(buf, "/");
-		strncat(buf, path, length);
+		snprintf(buf, PATH_MAX, "%s/%.*s", options.paths[n], length, path);
 
 		if(0 == access(buf, F_OK)) {
 			field->path_index = n+1;
@@ -519,64 +2068,1046 @@ int valid_field (const char* s, struct field_t* field)
 		}
 	}
 
-	return 0;
+	return resolve_tracked(field, path, length, buf);
 }
 
-int
-main(int argc, const char *argv[])
+int valid_field (const char* s, struct field_t* field)
 {
-	if (!isatty(fileno(stdout))) {
-		fprintf(stderr, "\033[1mError\033[0m: output is not a terminal\n");
-		exit(1);
+	char buf[PATH_MAX];
+
+	// Without -e, the file is only looked for once the field is selected,
+	// previewed or opened, rather than for every match up front
+	if (!options.only_existing) {
+		field->path_index = -1;
+		return 1;
 	}
 
-	pattern_list_t patterns;
-	patterns.count = 0;
-	init_patterns(&patterns);
-	add_default_patterns(&patterns);
+	return resolve_field(s, field, buf);
+}
 
-	readrc(&patterns);
+// With --format, output is matched a line at a time as it arrives and then
+// dropped, so memory use is bounded by the longest line.
+static struct {
+	char* v;
+	size_t nmemb;
+	size_t size;
+	size_t offset;  // of v in the whole output
+	const char *source;
+	shadow_t shadow;
+	size_t reported;
+} stream;
+
+// Matches a line of output as --format does, stripping it into shadow.
+// Sets clean to the field in the stripped line, field to where it is in
+// the output from offset on, and resolved to the file it names, if found.
+// Returns 0 if there's nothing to report.
+static int
+stream_match(shadow_t *shadow, const char *line, size_t length, size_t offset,
+             struct field_t *clean, struct field_t *field, char resolved[PATH_MAX], int *found)
+{
+	shadow_clear(shadow);
+	ansi_strip(shadow, line, length);
 
-	args(argc, argv);
+	memset(clean, 0, sizeof(*clean));
+	if (!match_line(shadow->v, shadow->nmemb, 0, &patterns, clean))
+		return 0;
 
-	if (patterns.count == 0) {
-		fprintf(stderr, "\033[1mError\033[0m: no patterns loaded!\n");
-		exit(1);
-	}
+	*found = resolve_field(shadow->v, clean, resolved);
+	if (!*found && options.only_existing)
+		return 0;
 
-	tinfo();
+	*field = *clean;
+	map_field(shadow, field);
+	shift_field(field, offset);
+	return 1;
+}
 
-	input_init(&in);
-	if(argc - optind > 0) {
-		if (run_utility() == 0 && !options.always_select)
-			exit(0);
-	} else {
-		while(input_read(&in, STDIN_FILENO, tty.width, 1))
-			;
+// Writes a match found by stream_match, given its stripped line
+static void
+stream_report(const char *s, size_t length, const struct field_t *clean, const struct field_t *field,
+              const char *resolved)
+{
+	const char *message, *end;
+	report_t report;
+
+	if (clean->ambiguous > 1) {
+		fprintf(stderr, "Warning: %.*s matches %d tracked files\n",
+			(int)(clean->path.stop - clean->path.start), s + clean->path.start, clean->ambiguous);
+		resolved = NULL;
 	}
 
-	if(in.nmemb == 0)
-		exit(0);
+	message = s + clean->match.stop;
+	end = s + length;
+	while (message < end && (*message == ':' || *message == ' '))
+		++message;
+
+	report.path = s + clean->path.start;
+	report.path_length = clean->path.stop - clean->path.start;
+	report.line = field_number(s, clean->line);
+	report.column = field_number(s, clean->column);
+	report.resolved = resolved;
+	report.pattern = clean->pattern;
+	report.source = stream.source;
+	report.offset = field->match.start;
+	report.message = message;
+	report.message_length = end - message;
+
+	report_match(stdout, options.format, &report);
+	++stream.reported;
+}
 
-	study(&patterns, in.v, in.nmemb, &valid_field);
+void
+stream_line(const char *line, size_t length, size_t offset)
+{
+	struct field_t field, clean;
+	char resolved[PATH_MAX];
+	int found;
 
-	if (field_count == 0)
-		return 0;
+	// With -1, only the first match is reported
+	if (options.first && stream.reported > 0)
+		return;
 
-	tsetup();
+	if (stream_match(&stream.shadow, line, length, offset, &clean, &field, resolved, &found))
+		stream_report(stream.shadow.v, stream.shadow.nmemb, &clean, &field, found ? resolved : NULL);
+}
+
+// Matches each complete line in v, returning the length of those lines
+size_t
+stream_lines(const char *v, size_t nmemb, size_t offset)
+{
+	const char *line = v, *newline;
+
+	while ((newline = memchr(line, '\n', v + nmemb - line)))
+	{
+		stream_line(line, newline - line, offset + (line - v));
+		line = newline + 1;
+	}
+
+	return line - v;
+}
+
+// Makes room to read into
+void
+stream_reserve(void)
+{
+	if (stream.size - stream.nmemb < BUFSIZ) {
+		stream.size = stream.size ? stream.size*2 : 4*BUFSIZ;
+		stream.v = realloc(stream.v, stream.size);
+		if (!stream.v) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+}
+
+// Reads what’s available from fd, matching any lines completed by it
+int
+stream_read(int fd)
+{
+	ssize_t n;
+
+	stream_reserve();
+
+	n = read(fd, stream.v + stream.nmemb, stream.size - stream.nmemb);
+	if (n < 0 && errno == EINTR)
+		return 1;
+	if (n <= 0) {
+		if (n < 0)
+			perror("read");
+		return 0;
+	}
+	stream.nmemb += n;
+
+	// Keep any incomplete line for next time
+	n = stream_lines(stream.v, stream.nmemb, stream.offset);
+	stream.offset += n;
+	stream.nmemb -= n;
+	memmove(stream.v, stream.v + n, stream.nmemb);
+
+	fflush(stdout);
+
+	return 1;
+}
+
+// Matches the last line, if the output didn’t end with a newline
+void
+stream_end(void)
+{
+	if (stream.nmemb > 0)
+		stream_line(stream.v, stream.nmemb, stream.offset);
+	stream.nmemb = 0;
+
+	report_end(stdout, options.format);
+	fflush(stdout);
+}
+
+// Whether the lines of output completed since checked have a match
+static int
+first_match(size_t *checked)
+{
+	struct field_t *fields = NULL;
+	size_t count = 0, size = 0, stop = in.nmemb;
+
+	while (stop > *checked && in.v[stop-1] != '\n')
+		--stop;
+	if (stop == *checked)
+		return 0;
+
+	study_fields(&patterns, in.v + *checked, stop - *checked, &valid_field, &fields, &count, &size);
+	free(fields);
+	*checked = stop;
+
+	return count > 0;
+}
+
+// Whether reading should stop before the utility’s done: with -1 once
+// something’s matched, or on Ctrl-C
+static int
+stop_early(size_t *checked)
+{
+	if (interrupted)
+		return 1;
+	if (!options.first)
+		return 0;
+	if (options.format)
+		return stream.reported > 0;
+	return first_match(checked);
+}
+
+// The command sessions are saved under
+void
+session_command(char command[BUFSIZ])
+{
+	int i;
+
+	command[0] = '\0';
+	if (!utility[0])
+		strcpy(command, "(stdin)");
+	for (i = 0; utility[i]; ++i)
+	{
+		if (i > 0)
+			strncat(command, " ", BUFSIZ - strlen(command) - 1);
+		strncat(command, utility[i], BUFSIZ - strlen(command) - 1);
+	}
+}
+
+// Caches the output and fields, so they can be reopened with --last
+void
+save_session(void)
+{
+	char cwd[PATH_MAX];
+	char command[BUFSIZ];
+	const char** paths;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		return;
+	session_command(command);
+
+	session.time = time(NULL);
+	session.cwd = cwd;
+	session.command = command;
+	// Directories from the git index follow those given with -p
+	paths = malloc((options.path_count + tracked.count + 1)*sizeof(*paths));
+	if (!paths) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(paths, options.paths, options.path_count*sizeof(*paths));
+	memcpy(paths + options.path_count, tracked.dirs, tracked.count*sizeof(*paths));
+
+	session.paths = paths;
+	session.path_count = options.path_count + tracked.count;
+	session.output = in.v;
+	session.output_size = in.nmemb;
+	session.fields = field_offsets;
+	session.field_count = field_count;
+
+	session_save(&session, sizeof(*field_offsets));
+	memset(&session, 0, sizeof(session));
+	free(paths);
+}
+
+// Compares the fields with those of the last run of the same command here,
+// before this run is saved in its place.  The last run’s fields are hashed
+// into a table, and any field whose hash isn’t in it is new.
+void
+diff_previous(void)
+{
+	const struct field_t* fields;
+	char cwd[PATH_MAX];
+	char command[BUFSIZ];
+	session_t previous;
+	uint64_t* table;
+	uint64_t h;
+	size_t size, i, j;
+
+	free(diff.fresh);
+	memset(&diff, 0, sizeof(diff));
+
+	// Piped input has no command to tell one run from another
+	if (!utility[0] || !getcwd(cwd, sizeof(cwd)))
+		return;
+	session_command(command);
+	if (!session_find(&previous, cwd, command, sizeof(*field_offsets)))
+		return;
+	if (!fields_within(previous.fields, previous.field_count, previous.output_size)) {
+		session_close(&previous);
+		return;
+	}
+
+	for (size = 64; size < previous.field_count*2; size *= 2)
+		;
+	table = calloc(size, sizeof(*table));
+	diff.fresh = calloc(field_count + 1, sizeof(*diff.fresh));
+	if (!table || !diff.fresh) {
+		perror("calloc");
+		exit(1);
+	}
+
+	// Hashes are made odd, leaving 0 for empty slots
+	fields = previous.fields;
+	for (i = 0; i < previous.field_count; ++i)
+	{
+		h = field_hash(previous.output, previous.output_size, &fields[i]) | 1;
+		for (j = h & (size-1); table[j] && table[j] != h; j = (j + 1) & (size-1))
+			;
+		table[j] = h;
+	}
+
+	for (i = 0; i < field_count; ++i)
+	{
+		h = field_hash(in.v, in.nmemb, &field_offsets[i]) | 1;
+		for (j = h & (size-1); table[j] && table[j] != h; j = (j + 1) & (size-1))
+			;
+		if (!table[j]) {
+			diff.fresh[i] = 1;
+			++diff.count;
+		}
+	}
+
+	// New fields are listed alone by default, unless that’s all or none
+	diff.only = diff.count > 0 && diff.count < field_count;
+
+	free(table);
+	session_close(&previous);
+}
+
+void
+load_session(void)
+{
+	int n;
+
+	if (!session_open(&session, options.last, sizeof(*field_offsets))) {
+		fprintf(stderr, "\033[1mError\033[0m: no session %d\n", options.last);
+		exit(1);
+	}
+	if (!fields_within(session.fields, session.field_count, session.output_size)) {
+		fprintf(stderr, "\033[1mError\033[0m: session %d is damaged\n", options.last);
+		exit(1);
+	}
+
+	// Paths in the output are relative to where it ran
+	if (chdir(session.cwd) < 0)
+		perror(session.cwd);
+
+	input_attach(&in, (char*)session.output, session.output_size);
+
+	field_count = field_size = session.field_count;
+	field_offsets = malloc(MAX(field_size, 1)*sizeof(*field_offsets));
+	if (!field_offsets) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(field_offsets, session.fields, field_count*sizeof(*field_offsets));
+
+	for (n = 0; n < session.path_count && n < 100; ++n)
+		options.paths[n] = (char*)session.paths[n];
+	options.path_count = n;
+	pthread_mutex_lock(&tracked.lock);
+	for (; n < session.path_count; ++n)
+		tracked_append(session.paths[n], strlen(session.paths[n]));
+	pthread_mutex_unlock(&tracked.lock);
+}
+
+#define TIMING_TOP 10 // entries in each part of the timing report
+#define TIMING_WIDTH 64 // columns of a line shown in the timing report
+
+struct timing {
+	const char* path;
+	size_t length;
+	long ms;
+	size_t count;
+};
+
+static int
+compare_paths(const void *a, const void *b)
+{
+	const struct timing *x = a, *y = b;
+	int r = memcmp(x->path, y->path, MIN(x->length, y->length));
+
+	return r ? r : (x->length > y->length) - (x->length < y->length);
+}
+
+static int
+compare_ms(const void *a, const void *b)
+{
+	const struct timing *x = a, *y = b;
+
+	return (x->ms < y->ms) - (x->ms > y->ms);
+}
+
+// Writes a line of the output, without colours and cut to fit
+static void
+timing_line(FILE* out, size_t index, shadow_t* shadow)
+{
+	size_t start = input_line_offset(&in, index);
+	size_t stop = index < in.nlines ? input_line_offset(&in, index+1) - 1 : in.nmemb;
+	const char *p, *end;
+	unsigned long cp;
+	int n, columns = 0;
+
+	shadow_clear(shadow);
+	ansi_strip(shadow, in.v + start, stop - start);
+
+	// Cut between characters, once it's TIMING_WIDTH columns wide
+	for (p = shadow->v, end = p + shadow->nmemb; p < end; p += n)
+		if (!(n = utf8_decode(p, end, &cp)) || (columns += codepoint_width(cp)) > TIMING_WIDTH)
+			break;
+	fprintf(out, "line %zu: %.*s\n", index+1, (int)(p - shadow->v), shadow->v);
+}
+
+// Reports the longest waits between lines of output, with the line that
+// came before each (such as the command a build was running), and the time
+// leading up to the matches for each file, from the match before
+void
+timing_report(FILE* out)
+{
+	struct timing gaps[TIMING_TOP + 1], *files;
+	size_t ngaps = 0, nfiles = 0, i, j, line;
+	long ms, previous = 0;
+	shadow_t shadow;
+
+	for (i = 0; (ms = input_line_time(&in, i)) >= 0; previous = ms, ++i)
+	{
+		// Lines read together weren’t waited for
+		if (ms - previous < 10)
+			continue;
+
+		// Kept longest first
+		for (j = ngaps; j > 0 && gaps[j-1].ms < ms - previous; --j)
+			gaps[j] = gaps[j-1];
+		gaps[j].ms = ms - previous;
+		gaps[j].count = i;
+		ngaps = MIN(ngaps + 1, TIMING_TOP);
+	}
+
+	files = malloc((field_count + 1) * sizeof(*files));
+	if (!files) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (previous = 0, i = 0; i < field_count; ++i)
+	{
+		line = find_line_index(&in, field_offsets[i].match.start);
+		if ((ms = input_line_time(&in, line)) < 0)
+			ms = previous;
+		files[nfiles].path = in.v + field_offsets[i].path.start;
+		files[nfiles].length = field_offsets[i].path.stop - field_offsets[i].path.start;
+		files[nfiles].ms = ms - previous;
+		files[nfiles].count = 1;
+		++nfiles;
+		previous = ms;
+	}
+
+	// Totals for each file
+	qsort(files, nfiles, sizeof(*files), compare_paths);
+	for (i = 0, j = 0; i < nfiles; ++i)
+	{
+		if (j > 0 && compare_paths(&files[j-1], &files[i]) == 0) {
+			files[j-1].ms += files[i].ms;
+			files[j-1].count += files[i].count;
+		} else {
+			files[j++] = files[i];
+		}
+	}
+	nfiles = j;
+	qsort(files, nfiles, sizeof(*files), compare_ms);
+
+	shadow_init(&shadow);
+
+	fprintf(out, "\n\033[1mLongest waits for output\033[0m\n");
+	for (i = 0; i < ngaps; ++i)
+	{
+		fprintf(out, "%9.2fs  ", gaps[i].ms / 1000.0);
+		if (gaps[i].count > 0)
+			timing_line(out, gaps[i].count - 1, &shadow);
+		else
+			fprintf(out, "before any output\n");
+	}
+
+	if (nfiles > 0)
+		fprintf(out, "\n\033[1mTime up to matches, by file\033[0m\n");
+	for (i = 0; i < nfiles && i < TIMING_TOP; ++i)
+		fprintf(out, "%9.2fs  %.*s (%zu)\n", files[i].ms / 1000.0, (int)files[i].length, files[i].path, files[i].count);
+
+	ms = in.line_times.count ? input_line_time(&in, in.line_times.count - 1) : 0;
+	fprintf(out, "\n%zu lines in %.2fs\n", in.nlines, ms / 1000.0);
+
+	shadow_free(&shadow);
+	free(files);
+}
+
+// Whether the arguments name log files to scan, rather than a utility:
+// all of them must be files which can’t be run.
+int
+log_files(int argc, const char **argv)
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; i < argc; ++i)
+		if (stat(argv[i], &st) < 0 || !S_ISREG(st.st_mode) || access(argv[i], X_OK) == 0)
+			return 0;
+
+	return argc > 0;
+}
+
+// The fields found in a chunk of the log files
+struct chunk_fields {
+	struct field_t *v;
+	size_t count;
+	size_t size;
+
+	// With --format, what stream_match found for each field, with its
+	// line stripped and the file it names kept in text
+	struct chunk_match {
+		struct field_t clean;
+		size_t line;
+		size_t length;
+		size_t resolved;  // or -1 if not found
+	} *matches;
+	char *text;
+	size_t text_length;
+	size_t text_size;
+};
+
+// Copies n bytes and a NUL to the end of the chunk's text, returning
+// where they went
+static size_t
+chunk_text(struct chunk_fields *fields, const char *s, size_t n)
+{
+	size_t offset = fields->text_length;
+
+	if (fields->text_size - offset < n + 1) {
+		while (fields->text_size - offset < n + 1)
+			fields->text_size = fields->text_size ? fields->text_size*2 : BUFSIZ;
+		fields->text = realloc(fields->text, fields->text_size);
+		if (!fields->text) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(fields->text + offset, s, n);
+	fields->text[offset + n] = '\0';
+	fields->text_length += n + 1;
+
+	return offset;
+}
+
+// Matches each line of a chunk for --format, so that scan_report only
+// has to write what's found
+static void
+scan_match(struct chunk_fields *fields, const char *s, size_t length, size_t offset)
+{
+	struct field_t field, clean;
+	struct chunk_match *match;
+	char resolved[PATH_MAX];
+	const char *line = s, *end = s + length, *newline;
+	shadow_t shadow;
+	int found;
+
+	shadow_init(&shadow);
+
+	for (; line < end; line = newline + 1)
+	{
+		if (!(newline = memchr(line, '\n', end - line)))
+			newline = end;
+		if (!stream_match(&shadow, line, newline - line, offset + (line - s), &clean, &field, resolved, &found))
+			continue;
+
+		if (fields->count == fields->size) {
+			fields->size = fields->size ? fields->size*2 : 64;
+			fields->v = realloc(fields->v, fields->size*sizeof(*fields->v));
+			fields->matches = realloc(fields->matches, fields->size*sizeof(*fields->matches));
+			if (!fields->v || !fields->matches) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		match = &fields->matches[fields->count];
+		fields->v[fields->count++] = field;
+
+		match->clean = clean;
+		match->length = shadow.nmemb;
+		match->line = chunk_text(fields, shadow.v, shadow.nmemb);
+		match->resolved = found ? chunk_text(fields, resolved, strlen(resolved)) : (size_t)-1;
+	}
+
+	shadow_free(&shadow);
+}
+
+void
+scan_work(scan_t *scan, struct scan_chunk *chunk, void *data)
+{
+	struct chunk_fields *fields = calloc(1, sizeof(*fields));
+
+	(void)data;
+	if (!fields) {
+		perror("calloc");
+		exit(1);
+	}
+	chunk->result = fields;
+
+	// Only an empty compressed file has an empty chunk
+	if (chunk->stop > chunk->start && options.format)
+		scan_match(fields, scan->sources[chunk->source].v + chunk->start, chunk->stop - chunk->start, chunk->start);
+	else if (chunk->stop > chunk->start)
+		study_fields(&patterns, scan->sources[chunk->source].v + chunk->start, chunk->stop - chunk->start,
+		             &valid_field, &fields->v, &fields->count, &fields->size);
+}
+
+// Adds each chunk to the output shown, with a heading for each file
+void
+scan_show(scan_t *scan, struct scan_chunk *chunk, void *data)
+{
+	const struct scan_source *source = &scan->sources[chunk->source];
+	struct chunk_fields *fields = chunk->result;
+	char heading[PATH_MAX + 16];
+	struct field_t *field;
+	size_t base, i;
+	int n;
+
+	(void)data;
+
+	if (chunk->start == 0) {
+		if (in.nmemb > 0 && in.v[in.nmemb-1] != '\n')
+			input_append(&in, "\n", 1);
+		n = snprintf(heading, sizeof(heading), "==> %s <==\n", source->path);
+		input_append(&in, heading, MIN((size_t)n, sizeof(heading)-1));
+	}
+
+	base = in.nmemb;
+	input_append(&in, source->v + chunk->start, chunk->stop - chunk->start);
+
+	for (i = 0; i < fields->count; ++i)
+	{
+		if (field_count == field_size) {
+			field_size = field_size ? field_size*2 : BUFSIZ;
+			field_offsets = realloc(field_offsets, field_size*sizeof(*field_offsets));
+			if (!field_offsets) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+
+		field = &field_offsets[field_count++];
+		*field = fields->v[i];
+		shift_field(field, base);
+	}
+
+	free(fields->v);
+	free(fields);
+}
+
+// Reads any output waiting in fds, returning whether the list is due to be
+// updated with it
+int
+follow_read(fd_set *fds)
+{
+	struct timeval timeout;
+	int n;
+
+	for (n = 0; n < PIPES; ++n)
+	{
+		if (follow.fds[n] < 0 || !FD_ISSET(follow.fds[n], fds))
+			continue;
+
+		// The end is news too, for the status and any unfinished line
+		if (!input_read(&in, follow.fds[n])) {
+			close(follow.fds[n]);
+			follow.fds[n] = -1;
+		}
+		follow.pending = 1;
+	}
+
+	follow_timeout(&timeout);
+	if (!follow.pending || timeout.tv_sec || timeout.tv_usec)
+		return 0;
+
+	follow.pending = 0;
+	clock_gettime(CLOCK_MONOTONIC, &follow.frame);
+	return 1;
+}
+
+// Matches the lines read since the last update, adding them to the list
+void
+follow_update(void)
+{
+	size_t stop = in.nmemb, from = field_count, i;
+	struct field_t *field;
+
+	// Leave an unfinished line for later, unless there’s no more to come
+	while (following() && stop > follow.studied && in.v[stop-1] != '\n')
+		--stop;
+	if (stop == follow.studied)
+		return;
+
+	study_fields(&patterns, in.v + follow.studied, stop - follow.studied, &valid_field,
+	             &field_offsets, &field_count, &field_size);
+
+	for (i = from; i < field_count; ++i)
+	{
+		field = &field_offsets[i];
+		shift_field(field, follow.studied);
+
+		filter_add(&filter.path, in.v + field->path.start, field->path.stop - field->path.start);
+	}
+	if (filter.active == &filter.line)
+		filter_build_line();
+
+	follow.studied = stop;
+
+	marks = realloc(marks, field_count + 1);
+	if (!marks) {
+		perror("realloc");
+		exit(1);
+	}
+	memset(marks + from, 0, field_count + 1 - from);
+}
+
+// Starts following the utility’s output, or stdin.  Compressed input isn’t
+// looked for, as that would wait for the first few bytes to arrive.
+void
+follow_start(int run)
+{
+	input_init(&in);
+	clock_gettime(CLOCK_MONOTONIC, &follow.frame);
+
+	// A copy of stdin, which is reopened on the terminal for the editor
+	if (run)
+		follow.pid = spawn_utility(follow.fds, 0);
+	else if ((follow.fds[0] = dup(STDIN_FILENO)) < 0) {
+		perror("dup");
+		exit(1);
+	}
+}
+
+// Stops the utility if it’s still running, without reading any more
+static void
+utility_stop(void)
+{
+	int n;
+
+	for (n = 0; n < PIPES; ++n) {
+		if (follow.fds[n] >= 0)
+			close(follow.fds[n]);
+		follow.fds[n] = -1;
+	}
+
+	if (follow.pid > 0) {
+		kill(-follow.pid, SIGTERM);
+		waitpid(follow.pid, NULL, 0);
+	}
+	follow.pid = 0;
+
+	if (drained > 0 && waitpid(drained, NULL, WNOHANG) != 0)
+		drained = 0;
+}
+
+// Stops the utility if it’s still running, and keeps what was read
+void
+follow_stop(void)
+{
+	follow_update();
+	utility_stop();
+	save_session();
+}
+
+// Runs the utility again without tearing down the interface, its output
+// matched with the patterns already compiled as it’s read, as with -f.
+// One still running is stopped first.
+void
+rerun_start(void)
+{
+	utility_stop();
+
+	input_free(&in);
+	input_init(&in);
+	field_count = 0;
+	tracked_reset();
+	free(diff.fresh);
+	memset(&diff, 0, sizeof(diff));
+
+	follow.studied = 0;
+	follow.pending = 0;
+	clock_gettime(CLOCK_MONOTONIC, &follow.frame);
+	follow.pid = spawn_utility(follow.fds, 0);
+}
+
+// Once the rerun’s output has all been matched, compares it with the last
+// run and saves it, returning whether files were edited while it ran
+int
+rerun_finish(void)
+{
+	waitpid(follow.pid, NULL, 0);
+	follow.pid = 0;
+
+	diff_previous();
+	save_session();
+
+	return watch_edited(watch_fd);
+}
+
+// Writes the matches in each chunk, for --format
+void
+scan_report(scan_t *scan, struct scan_chunk *chunk, void *data)
+{
+	struct chunk_fields *fields = chunk->result;
+	struct chunk_match *match;
+	size_t i;
+
+	(void)data;
+
+	stream.source = scan->sources[chunk->source].path;
+
+	// With -1, only the first match is reported
+	for (i = 0; i < fields->count && !(options.first && stream.reported > 0); ++i)
+	{
+		match = &fields->matches[i];
+		stream_report(fields->text + match->line, match->length, &match->clean, &fields->v[i],
+		              match->resolved == (size_t)-1 ? NULL : fields->text + match->resolved);
+	}
+
+	fflush(stdout);
+
+	free(fields->v);
+	free(fields->matches);
+	free(fields->text);
+	free(fields);
+}
+
+// Matches the log files named on the command line, in parallel
+void
+scan_logs(int argc, const char **argv, scan_work_t *done)
+{
+	scan_t scan;
+	int i;
+
+	scan_init(&scan);
+
+	for (i = 0; i < argc; ++i)
+	{
+		if (!scan_add(&scan, argv[i], options.recursive)) {
+			perror(argv[i]);
+			exit(1);
+		}
+	}
+
+	scan_run(&scan, scan_work, done, NULL);
+	scan_free(&scan);
+}
+
+// Matches without the interface, for --format
+int
+stream_run(int argc, const char **argv)
+{
+	char peek[DECOMPRESS_PEEK];
+	size_t consumed, npeek, checked = 0;
+	int status = 0, fd;
+
+	report_begin(stdout, options.format);
+
+	if (options.last) {
+		load_session();
+		consumed = stream_lines(in.v, in.nmemb, 0);
+		stream_line(in.v + consumed, in.nmemb - consumed, consumed);
+	} else if (options.scan) {
+		scan_logs(argc - optind, argv + optind, scan_report);
+	} else if (argc - optind > 0) {
+		status = run_utility(0);
+	} else {
+		fd = decompress_fd(STDIN_FILENO, peek, &npeek);
+		stream_reserve();
+		memcpy(stream.v, peek, npeek);
+		stream.nmemb = npeek;
+
+		catch_interrupt(1);
+		while (!stop_early(&checked) && stream_read(fd))
+			;
+		catch_interrupt(0);
+	}
+
+	stream_end();
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	char peek[DECOMPRESS_PEEK];
+	size_t rows, npeek, checked = 0;
+	int fd, status = 0;
+
+	patterns.count = 0;
+	init_patterns(&patterns);
+	add_default_patterns(&patterns);
+
+	readrc(&patterns);
+
+	args(argc, argv);
+
+	options.scan = options.recursive || log_files(argc - optind, argv + optind);
+
+	if (options.list_sessions) {
+		session_list(stdout);
+		exit(0);
+	}
+
+	if (options.format) {
+		if (patterns.count == 0 || options.watch) {
+			fprintf(stderr, "\033[1mError\033[0m: %s\n", options.watch ? "--format can’t watch" : "no patterns loaded!");
+			exit(1);
+		}
+		return stream_run(argc, argv);
+	}
+
+	if (!isatty(fileno(stdout))) {
+		fprintf(stderr, "\033[1mError\033[0m: output is not a terminal\n");
+		exit(1);
+	}
+
+	if (patterns.count == 0) {
+		fprintf(stderr, "\033[1mError\033[0m: no patterns loaded!\n");
+		exit(1);
+	}
+
+	if (options.watch && (options.last || options.scan || argc - optind == 0)) {
+		fprintf(stderr, "\033[1mError\033[0m: watch mode needs a utility to run\n");
+		exit(1);
+	}
+
+	if (options.follow && (options.last || options.scan || options.watch || options.timing)) {
+		fprintf(stderr, "\033[1mError\033[0m: follow mode needs output as it’s written\n");
+		exit(1);
+	}
+
+	if (options.first && options.watch && !options.kill_utility) {
+		fprintf(stderr, "\033[1mError\033[0m: watch mode needs -k with -1\n");
+		exit(1);
+	}
+
+	if (options.timing && (options.last || options.scan || options.watch)) {
+		fprintf(stderr, "\033[1mError\033[0m: --timing needs output as it’s written\n");
+		exit(1);
+	}
+
+	tinfo();
+
+	// Watched from the start, to learn what the utility writes itself
+	if (options.watch && (watch_fd = watch_init(".")) < 0)
+		exit(1);
+
+	if (options.last) {
+		load_session();
+	} else if (options.follow) {
+		follow_start(argc - optind > 0);
+	} else {
+		input_init(&in);
+		if (options.scan) {
+			scan_logs(argc - optind, argv + optind, scan_show);
+		} else if(argc - optind > 0) {
+			status = run_utility(1);
+			if (status == 0 && !options.always_select && !options.watch && !options.timing)
+				exit(0);
+		} else {
+			// Compressed input is read through a pipe from another thread
+			fd = decompress_fd(STDIN_FILENO, peek, &npeek);
+			input_append(&in, peek, npeek);
+
+			catch_interrupt(1);
+			while(!stop_early(&checked) && input_read(&in, fd))
+				echo_output(0);
+			echo_output(1);
+			catch_interrupt(0);
+		}
+
+		if(in.nmemb == 0 && !options.watch)
+			exit(0);
+
+		// Anything -1 matched on the way has been thrown away
+		if(in.nmemb > 0 && !options.scan) {
+			tracked_reset();
+			study(&patterns, in.v, in.nmemb, &valid_field);
+		}
+
+		diff_previous();
+		save_session();
+		if (watch_fd >= 0)
+			watch_edited(watch_fd);
+	}
+
+	if (options.timing) {
+		timing_report(stdout);
+		return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+	}
+
+	if (field_count == 0 && !options.watch && !options.follow)
+		return 0;
+
+	tsetup();
 
 	// Since we echo the input as we receive it,
 	// we need to rewind back up to the start.
-	if (in.nlines)
-		tprintf(T_CURSOR_UP, MIN(in.nlines, tty.height));
+	if (!options.last && !options.scan && !options.follow) {
+		tsize();
+		rows = input_rows_back(&in, tty.width, tty.height);
+		if (rows)
+			tprintf(T_CURSOR_UP, rows);
+	}
 	tprintf(T_COLUMN_ADDRESS, 1);
 	tputs(T_ERASE_DOWN);
 
-	tmain();
-	tend();
+	for (;;) {
+		tmain();
+		tend();
+
+		if (selection_index < 0)
+			break;
 
-	if (selection_index >= 0)
 		editor();
 
+		// Back to the list after editing, where saving triggers a rerun,
+		// or more output may have come
+		if (!options.watch && !options.follow)
+			break;
+
+		selection_index = -1;
+		tinfo();
+		tsetup();
+
+		if (view.count)
+			tprintf(T_CURSOR_UP, view.count);
+		tprintf(T_COLUMN_ADDRESS, 1);
+		tputs(T_ERASE_DOWN);
+	}
+
+	// A rerun left unfinished isn’t saved over the last whole one
+	if (options.follow)
+		follow_stop();
+	else
+		utility_stop();
+
 	return 0;
 }
@@ -0,0 +1,51 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "daemon.h"
+
+static char socket_path[PATH_MAX];
+
+// Leaves no socket behind to be connected to
+void
+stop(int sig)
+{
+	(void)sig;
+	unlink(socket_path);
+	_exit(0);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct sigaction sa;
+
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+		puts("usage: plsd [socket]\n"
+		     "\nKeeps the git index of each repository pls runs in, so a large one is"
+		     "\nread once rather than by every run.  pls uses it when it’s running.");
+		exit(argc == 2 && strcmp(argv[1], "-h") == 0 ? 0 : 1);
+	}
+
+	if (argc == 2) {
+		snprintf(socket_path, sizeof(socket_path), "%s", argv[1]);
+	} else if (!daemon_socket(socket_path)) {
+		fprintf(stderr, "\033[1mError\033[0m: %.*s isn’t private to this user\n",
+		        (int)(strrchr(socket_path, '/') - socket_path), socket_path);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	// Clients which go away mid-reply are noticed when writing fails
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	return daemon_serve(socket_path) ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "preview.h"
+
+void
+preview_init (preview_t* preview)
+{
+	memset(preview, 0, sizeof(*preview));
+}
+
+static void
+release (struct preview_file* file)
+{
+	// A slot never used is all zeroes, which input_free would take for a
+	// spill file on descriptor 0
+	if (!file->path)
+		return;
+
+	if (file->map_size > 0)
+		munmap(file->lines.v, file->map_size);
+	input_free(&file->lines);
+	free(file->path);
+	memset(file, 0, sizeof(*file));
+}
+
+void
+preview_free (preview_t* preview)
+{
+	size_t i;
+
+	for (i = 0; i < preview->count; ++i)
+		release(&preview->files[i]);
+	preview->count = 0;
+}
+
+input_t*
+preview_file (preview_t* preview, const char* path)
+{
+	struct preview_file* file = NULL;
+	struct stat st;
+	void* v = "";
+	size_t i;
+	int fd;
+
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	for (i = 0; i < preview->count && !file; ++i)
+		if (strcmp(preview->files[i].path, path) == 0)
+			file = &preview->files[i];
+
+	// A file that’s changed since is read again
+	if (file && file->mtime == st.st_mtime && file->lines.nmemb == (size_t)st.st_size) {
+		file->used = ++preview->clock;
+		return &file->lines;
+	}
+
+	if (st.st_size > 0) {
+		if ((fd = open(path, O_RDONLY)) < 0)
+			return NULL;
+		v = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (v == MAP_FAILED)
+			return NULL;
+	}
+
+	// Otherwise take a free slot, or the one shown longest ago
+	if (!file && preview->count < PREVIEW_FILES) {
+		file = &preview->files[preview->count++];
+	} else if (!file) {
+		file = &preview->files[0];
+		for (i = 1; i < preview->count; ++i)
+			if (preview->files[i].used < file->used)
+				file = &preview->files[i];
+	}
+	release(file);
+
+	file->path = malloc(strlen(path) + 1);
+	if (!file->path) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(file->path, path);
+	file->map_size = st.st_size;
+	file->mtime = st.st_mtime;
+	file->used = ++preview->clock;
+	input_attach(&file->lines, v, st.st_size);
+
+	return &file->lines;
+}
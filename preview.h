@@ -0,0 +1,29 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <time.h>
+#include "input.h"
+
+#define PREVIEW_FILES 256 // files kept mapped at once
+
+// Source files shown in the preview pane, mapped and their lines indexed
+// when first shown, and kept until the least recently shown is replaced.
+typedef struct {
+	struct preview_file {
+		char* path;
+		input_t lines;
+		size_t map_size;
+		time_t mtime;       // to notice the file being edited
+		unsigned long used;
+	} files[PREVIEW_FILES];
+	size_t count;
+	unsigned long clock;
+} preview_t;
+
+void preview_init (preview_t* preview);
+void preview_free (preview_t* preview);
+
+// The lines of a file, or NULL if it can’t be read
+input_t* preview_file (preview_t* preview, const char* path);
+
+#endif
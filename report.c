@@ -0,0 +1,174 @@
+#include <string.h>
+#include "report.h"
+
+#define SARIF_SCHEMA "https://json.schemastore.org/sarif-2.1.0.json"
+
+static int reported; // matches written so far, for the separators
+
+enum report_format
+report_format (const char* name)
+{
+	if (strcmp(name, "json") == 0)
+		return REPORT_JSON;
+	if (strcmp(name, "quickfix") == 0)
+		return REPORT_QUICKFIX;
+	if (strcmp(name, "sarif") == 0)
+		return REPORT_SARIF;
+	return REPORT_NONE;
+}
+
+static void
+json_string (FILE* out, const char* s, size_t n)
+{
+	const char* end = s + n;
+	const char* run;
+
+	putc('"', out);
+	while (s < end)
+	{
+		// Write plain runs in one go
+		for (run = s; s < end && (unsigned char)*s >= 0x20 && *s != '"' && *s != '\\'; ++s)
+			;
+		fwrite(run, 1, s - run, out);
+		if (s == end)
+			break;
+
+		switch (*s) {
+		case '"':  fputs("\\\"", out); break;
+		case '\\': fputs("\\\\", out); break;
+		case '\t': fputs("\\t", out); break;
+		case '\r': fputs("\\r", out); break;
+		default:   fprintf(out, "\\u%04x", (unsigned char)*s); break;
+		}
+		++s;
+	}
+	putc('"', out);
+}
+
+static void
+json_number (FILE* out, long n)
+{
+	if (n > 0)
+		fprintf(out, "%ld", n);
+	else
+		fputs("null", out);
+}
+
+// A file URI, or a relative reference, escaping anything outside the
+// unreserved characters and path separators
+static void
+json_uri (FILE* out, const char* s, size_t n)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned char c;
+	size_t i;
+
+	putc('"', out);
+	if (n > 0 && s[0] == '/')
+		fputs("file://", out);
+	for (i = 0; i < n; ++i)
+	{
+		c = s[i];
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c && strchr("-._~/", c))) {
+			putc(c, out);
+		} else {
+			putc('%', out);
+			putc(hex[c >> 4], out);
+			putc(hex[c & 15], out);
+		}
+	}
+	putc('"', out);
+}
+
+void
+report_begin (FILE* out, enum report_format format)
+{
+	reported = 0;
+
+	if (format == REPORT_SARIF)
+		fputs("{\"version\":\"2.1.0\",\"$schema\":\"" SARIF_SCHEMA "\",\"runs\":[{"
+		      "\"tool\":{\"driver\":{\"name\":\"pls\",\"version\":\"" VERSION "\"}},"
+		      "\"results\":[\n", out);
+}
+
+void
+report_match (FILE* out, enum report_format format, const report_t* report)
+{
+	const char* path = report->resolved;
+
+	switch (format) {
+	case REPORT_JSON:
+		fputs("{\"path\":", out);
+		json_string(out, report->path, report->path_length);
+		fputs(",\"line\":", out);
+		json_number(out, report->line);
+		fputs(",\"column\":", out);
+		json_number(out, report->column);
+		fputs(",\"resolved\":", out);
+		if (path)
+			json_string(out, path, strlen(path));
+		else
+			fputs("null", out);
+		fprintf(out, ",\"pattern\":%d", report->pattern);
+		if (report->source) {
+			fputs(",\"source\":", out);
+			json_string(out, report->source, strlen(report->source));
+		}
+		fprintf(out, ",\"offset\":%zu,\"message\":", report->offset);
+		json_string(out, report->message, report->message_length);
+		fputs("}\n", out);
+		break;
+
+	case REPORT_QUICKFIX:
+		if (path)
+			fputs(path, out);
+		else
+			fwrite(report->path, 1, report->path_length, out);
+		if (report->line > 0)
+			fprintf(out, ":%ld", report->line);
+		if (report->line > 0 && report->column > 0)
+			fprintf(out, ":%ld", report->column);
+		fputs(": ", out);
+		fwrite(report->message, 1, report->message_length, out);
+		putc('\n', out);
+		break;
+
+	case REPORT_SARIF:
+		if (reported)
+			fputs(",\n", out);
+		fprintf(out, "{\"ruleId\":\"pattern-%d\",\"message\":{\"text\":", report->pattern);
+		json_string(out, report->message, report->message_length);
+		fputs("},\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":", out);
+		if (path)
+			json_uri(out, path, strlen(path));
+		else
+			json_uri(out, report->path, report->path_length);
+		putc('}', out);
+		if (report->line > 0) {
+			fprintf(out, ",\"region\":{\"startLine\":%ld", report->line);
+			if (report->column > 0)
+				fprintf(out, ",\"startColumn\":%ld", report->column);
+			putc('}', out);
+		}
+		fputs("}}],\"properties\":{", out);
+		if (report->source) {
+			fputs("\"source\":", out);
+			json_string(out, report->source, strlen(report->source));
+			putc(',', out);
+		}
+		fprintf(out, "\"offset\":%zu}}", report->offset);
+		break;
+
+	case REPORT_NONE:
+		break;
+	}
+
+	++reported;
+}
+
+void
+report_end (FILE* out, enum report_format format)
+{
+	if (format == REPORT_SARIF)
+		fputs("\n]}]}\n", out);
+}
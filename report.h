@@ -0,0 +1,35 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdio.h>
+
+enum report_format {
+	REPORT_NONE,
+	REPORT_JSON,      // one object per line
+	REPORT_QUICKFIX,  // path:line:column: message, for vim -q
+	REPORT_SARIF,
+};
+
+// A match, as written by --format
+typedef struct {
+	const char* path;
+	size_t path_length;
+	long line;            // 0 if not given
+	long column;
+	const char* resolved; // the file found, or NULL
+	int pattern;
+	const char* source;   // the log file, when there are several
+	size_t offset;        // of the match in the output, or the source
+	const char* message;
+	size_t message_length;
+} report_t;
+
+// REPORT_NONE for an unknown name
+enum report_format report_format (const char* name);
+
+// Matches are written as they’re given, between report_begin and report_end
+void report_begin (FILE* out, enum report_format format);
+void report_match (FILE* out, enum report_format format, const report_t* report);
+void report_end (FILE* out, enum report_format format);
+
+#endif
@@ -0,0 +1,303 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "decompress.h"
+#include "scan.h"
+
+#define MAX_WORKERS 64
+
+void
+scan_init (scan_t* scan)
+{
+	memset(scan, 0, sizeof(*scan));
+}
+
+void
+scan_free (scan_t* scan)
+{
+	size_t i;
+
+	for (i = 0; i < scan->nsources; ++i)
+	{
+		if (scan->sources[i].v != scan->sources[i].map)
+			free((void*)scan->sources[i].v);
+		if (scan->sources[i].map_size > 0)
+			munmap((void*)scan->sources[i].map, scan->sources[i].map_size);
+		free(scan->sources[i].path);
+	}
+
+	free(scan->sources);
+	free(scan->chunks);
+	memset(scan, 0, sizeof(*scan));
+}
+
+static void*
+grow (void* v, size_t* size, size_t count, size_t width)
+{
+	if (count < *size)
+		return v;
+
+	*size = *size ? *size*2 : 64;
+	v = realloc(v, *size*width);
+	if (!v) {
+		perror("realloc");
+		exit(1);
+	}
+	return v;
+}
+
+// Splits a source into chunks which end at a newline
+static void
+add_chunks (scan_t* scan, size_t source)
+{
+	const struct scan_source* s = &scan->sources[source];
+	const char* newline;
+	size_t start = 0, stop;
+
+	while (start < s->size)
+	{
+		stop = start + SCAN_CHUNK;
+		if (stop >= s->size || compression(s->v, s->size) != COMPRESSION_NONE)
+			stop = s->size;
+		else if ((newline = memchr(s->v + stop, '\n', s->size - stop)))
+			stop = newline - s->v + 1;
+		else
+			stop = s->size;
+
+		scan->chunks = grow(scan->chunks, &scan->chunk_size, scan->nchunks, sizeof(*scan->chunks));
+		scan->chunks[scan->nchunks].source = source;
+		scan->chunks[scan->nchunks].start = start;
+		scan->chunks[scan->nchunks].stop = stop;
+		scan->chunks[scan->nchunks].result = NULL;
+		++scan->nchunks;
+
+		start = stop;
+	}
+}
+
+static int
+add_file (scan_t* scan, const char* path, size_t size)
+{
+	struct scan_source* s;
+	void* v = NULL;
+	int fd;
+
+	if (size > 0) {
+		if ((fd = open(path, O_RDONLY)) < 0)
+			return 0;
+		v = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (v == MAP_FAILED)
+			return 0;
+	}
+
+	scan->sources = grow(scan->sources, &scan->source_size, scan->nsources, sizeof(*scan->sources));
+	s = &scan->sources[scan->nsources];
+	s->path = malloc(strlen(path) + 1);
+	if (!s->path) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(s->path, path);
+	s->v = s->map = v;
+	s->size = s->map_size = size;
+
+	add_chunks(scan, scan->nsources++);
+
+	return 1;
+}
+
+static int
+compare_names (const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Adds the files under a directory in name order, skipping hidden ones
+static int
+add_dir (scan_t* scan, const char* path)
+{
+	DIR* d = opendir(path);
+	struct dirent* entry;
+	struct stat st;
+	char** names = NULL;
+	size_t count = 0, size = 0, i;
+	char* child;
+
+	if (!d)
+		return 0;
+
+	while ((entry = readdir(d)))
+	{
+		if (entry->d_name[0] == '.')
+			continue;
+
+		names = grow(names, &size, count, sizeof(*names));
+		names[count] = malloc(strlen(path) + strlen(entry->d_name) + 2);
+		if (!names[count]) {
+			perror("malloc");
+			exit(1);
+		}
+		child = names[count++];
+		strcpy(child, path);
+		if (child[strlen(child)-1] != '/')
+			strcat(child, "/");
+		strcat(child, entry->d_name);
+	}
+	closedir(d);
+
+	qsort(names, count, sizeof(*names), compare_names);
+
+	// Unreadable files further down are reported but don’t stop the rest.
+	// Symbolic links to directories aren’t followed, and special files skipped.
+	for (i = 0; i < count; ++i)
+	{
+		if (lstat(names[i], &st) < 0)
+			perror(names[i]);
+		else if (S_ISLNK(st.st_mode) && (stat(names[i], &st) < 0 || S_ISDIR(st.st_mode)))
+			;
+		else if ((S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) && !scan_add(scan, names[i], 1))
+			perror(names[i]);
+		free(names[i]);
+	}
+	free(names);
+
+	return 1;
+}
+
+int
+scan_add (scan_t* scan, const char* path, int recursive)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return 0;
+
+	if (S_ISDIR(st.st_mode)) {
+		if (!recursive) {
+			errno = EISDIR;
+			return 0;
+		}
+		return add_dir(scan, path);
+	}
+
+	return add_file(scan, path, st.st_size);
+}
+
+struct pool {
+	scan_t* scan;
+	scan_work_t* work;
+	void* data;
+
+	pthread_mutex_t lock;
+	pthread_cond_t worked;
+	size_t next;            // chunk to hand out
+	unsigned char* done;    // per chunk
+};
+
+// Decompresses the source of a chunk, which is the whole of it
+static void
+inflate_source (scan_t* scan, struct scan_chunk* chunk)
+{
+	struct scan_source* s = &scan->sources[chunk->source];
+	char* v;
+	size_t size;
+
+	if (compression(s->map, s->map_size) == COMPRESSION_NONE)
+		return;
+
+	if (!decompress_buffer(s->map, s->map_size, &v, &size))
+		fprintf(stderr, "Warning: %s is corrupt or cut short\n", s->path);
+
+	s->v = v;
+	s->size = chunk->stop = size;
+}
+
+static void*
+worker (void* arg)
+{
+	struct pool* pool = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (i >= pool->scan->nchunks)
+			return NULL;
+
+		inflate_source(pool->scan, &pool->scan->chunks[i]);
+		pool->work(pool->scan, &pool->scan->chunks[i], pool->data);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->done[i] = 1;
+		pthread_cond_broadcast(&pool->worked);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void
+scan_run (scan_t* scan, scan_work_t* work, scan_work_t* done, void* data)
+{
+	pthread_t threads[MAX_WORKERS];
+	struct pool pool;
+	long n = 4;
+	size_t i, count;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	count = n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : (size_t)n;
+	if (count > scan->nchunks)
+		count = scan->nchunks;
+
+	pool.scan = scan;
+	pool.work = work;
+	pool.data = data;
+	pool.next = 0;
+	pool.done = calloc(scan->nchunks + 1, 1);
+	if (!pool.done) {
+		perror("calloc");
+		exit(1);
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.worked, NULL);
+
+	for (n = 0; (size_t)n < count; ++n)
+	{
+		if ((errno = pthread_create(&threads[n], NULL, worker, &pool)) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	count = n;
+
+	// Without any threads, do the work here
+	if (count == 0)
+		worker(&pool);
+
+	for (i = 0; i < scan->nchunks; ++i)
+	{
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.done[i])
+			pthread_cond_wait(&pool.worked, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		done(scan, &scan->chunks[i], data);
+	}
+
+	for (i = 0; i < count; ++i)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&pool.worked);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.done);
+}
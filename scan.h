@@ -0,0 +1,45 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+#define SCAN_CHUNK (4 << 20) // bytes of a file given to each worker
+
+// Log files mapped and split into chunks of whole lines, for matching in
+// parallel.  Results are handed back chunk by chunk, in order.  Compressed
+// files are one chunk each, decompressed by the worker which takes it.
+typedef struct {
+	struct scan_source {
+		char* path;
+		const char* v;      // contents, once decompressed if need be
+		size_t size;
+		const char* map;    // the file as mapped
+		size_t map_size;
+	} *sources;
+	size_t nsources;
+	size_t source_size;
+
+	struct scan_chunk {
+		size_t source;      // index into sources
+		size_t start;       // range of the source
+		size_t stop;
+		void* result;       // for the callbacks
+	} *chunks;
+	size_t nchunks;
+	size_t chunk_size;
+} scan_t;
+
+typedef void (scan_work_t) (scan_t* scan, struct scan_chunk* chunk, void* data);
+
+void scan_init (scan_t* scan);
+void scan_free (scan_t* scan);
+
+// Adds a file, or with recursive every file under a directory.
+// Returns 0 and sets errno if path can’t be read.
+int scan_add (scan_t* scan, const char* path, int recursive);
+
+// Calls work on each chunk from a pool of threads, and then done on each
+// chunk in turn from this one, as soon as it and those before it are worked.
+void scan_run (scan_t* scan, scan_work_t* work, scan_work_t* done, void* data);
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "seq.h"
+
+void
+seq_init (seq_t* seq)
+{
+	memset(seq, 0, sizeof(*seq));
+}
+
+void
+seq_free (seq_t* seq)
+{
+	size_t n;
+
+	for (n = 0; n * SEQ_BLOCK < seq->count; ++n)
+		free(seq->blocks[n].wide);
+	free(seq->blocks);
+	memset(seq, 0, sizeof(*seq));
+}
+
+static size_t
+block_get (const seq_block_t* block, size_t j)
+{
+	switch (block->wide_bytes) {
+	case 4:
+		return block->base + ((const uint32_t*)block->wide)[j];
+	case 8:
+		return block->base + ((const uint64_t*)block->wide)[j];
+	default:
+		return block->base + block->delta[j];
+	}
+}
+
+// Moves the block’s deltas to a wider array
+static void
+widen (seq_block_t* block, size_t used, unsigned char bytes)
+{
+	void* wide = calloc(SEQ_BLOCK, bytes);
+	size_t j;
+
+	if (!wide) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (j = 0; j < used; ++j)
+	{
+		size_t d = block_get(block, j) - block->base;
+		if (bytes == 4)
+			((uint32_t*)wide)[j] = d;
+		else
+			((uint64_t*)wide)[j] = d;
+	}
+
+	free(block->wide);
+	block->wide = wide;
+	block->wide_bytes = bytes;
+}
+
+void
+seq_push (seq_t* seq, size_t value)
+{
+	size_t b = seq->count / SEQ_BLOCK;
+	size_t j = seq->count % SEQ_BLOCK;
+	seq_block_t* block;
+	size_t d;
+
+	if (j == 0) {
+		if (b == seq->block_size) {
+			seq->block_size = seq->block_size ? seq->block_size*2 : 64;
+			seq->blocks = realloc(seq->blocks, seq->block_size*sizeof(*seq->blocks));
+			if (!seq->blocks) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		memset(&seq->blocks[b], 0, sizeof(*seq->blocks));
+		seq->blocks[b].base = value;
+	}
+
+	block = &seq->blocks[b];
+	d = value - block->base;
+
+	if (block->wide_bytes == 0 && d > UINT16_MAX)
+		widen(block, j, 4);
+	if (block->wide_bytes == 4 && d > UINT32_MAX)
+		widen(block, j, 8);
+
+	switch (block->wide_bytes) {
+	case 4:
+		((uint32_t*)block->wide)[j] = d;
+		break;
+	case 8:
+		((uint64_t*)block->wide)[j] = d;
+		break;
+	default:
+		block->delta[j] = d;
+	}
+
+	++seq->count;
+}
+
+size_t
+seq_get (const seq_t* seq, size_t index)
+{
+	return block_get(&seq->blocks[index / SEQ_BLOCK], index % SEQ_BLOCK);
+}
+
+size_t
+seq_find (const seq_t* seq, size_t value)
+{
+	size_t lo = 0, hi = (seq->count + SEQ_BLOCK - 1) / SEQ_BLOCK;
+	size_t b, n;
+
+	if (seq->count == 0)
+		return 0;
+
+	// The checkpoints narrow it down to one block
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (seq->blocks[mid].base <= value)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	b = lo;
+	lo = 0;
+	hi = seq->count - b * SEQ_BLOCK;
+	if (hi > SEQ_BLOCK)
+		hi = SEQ_BLOCK;
+
+	while (hi - lo > 1)
+	{
+		n = lo + (hi - lo) / 2;
+		if (block_get(&seq->blocks[b], n) <= value)
+			lo = n;
+		else
+			hi = n;
+	}
+
+	return b * SEQ_BLOCK + lo;
+}
@@ -0,0 +1,35 @@
+#ifndef SEQ_H
+#define SEQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEQ_BLOCK 64
+
+// A non-decreasing sequence of offsets, stored in blocks of 16-bit deltas
+// from an absolute base.  A block only takes wider deltas once it spans
+// 64KiB or more, so a line index costs under 2.5 bytes per line rather than
+// 8, and any entry is still found in constant time.
+typedef struct {
+	size_t base;
+	void *wide;               // 32 or 64-bit deltas, if needed
+	unsigned char wide_bytes; // 0, 4 or 8
+	uint16_t delta[SEQ_BLOCK];
+} seq_block_t;
+
+typedef struct {
+	seq_block_t *blocks;
+	size_t block_size;        // current size of the blocks array
+	size_t count;             // number of entries
+} seq_t;
+
+void seq_init (seq_t* seq);
+void seq_free (seq_t* seq);
+
+void seq_push (seq_t* seq, size_t value);
+size_t seq_get (const seq_t* seq, size_t index);
+
+// Index of the last entry not greater than value (0 if there isn’t one)
+size_t seq_find (const seq_t* seq, size_t value);
+
+#endif
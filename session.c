@@ -0,0 +1,353 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "session.h"
+
+#define SESSION_MAGIC "PLS1"
+#define SESSION_SUFFIX ".pls"
+
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+// File layout: header, strings (cwd, command, then each path, all NUL
+// terminated), fields, and then the output itself with a NUL after it.
+// The strings are padded so the fields are aligned in the mapping.
+struct session_header {
+	char magic[4];
+	uint32_t field_bytes;
+	int64_t time;
+	uint64_t output_size;
+	uint64_t field_count;
+	uint32_t strings_length;
+	uint32_t path_count;
+};
+
+// The cache directory, created if necessary.
+// This function returns a string using internal static storage.
+static const char*
+session_dir (void)
+{
+	static char dir[PATH_MAX];
+	const char* env;
+
+	if ((env = getenv("PLS_CACHE"))) {
+		snprintf(dir, sizeof(dir), "%s", env);
+	} else if ((env = getenv("XDG_CACHE_HOME"))) {
+		snprintf(dir, sizeof(dir), "%s/pls", env);
+	} else if ((env = getenv("HOME"))) {
+		snprintf(dir, sizeof(dir), "%s/.cache", env);
+		mkdir(dir, 0700);
+		snprintf(dir, sizeof(dir), "%s/.cache/pls", env);
+	} else {
+		return NULL;
+	}
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return NULL;
+
+	return dir;
+}
+
+static int
+compare_names (const void* a, const void* b)
+{
+	// Most recent first
+	return strcmp(*(char* const*)b, *(char* const*)a);
+}
+
+// Session file names, most recent first; the caller frees them
+static size_t
+session_names (const char* dir, char*** names)
+{
+	DIR* d = opendir(dir);
+	struct dirent* entry;
+	size_t count = 0, size = 0, len;
+
+	*names = NULL;
+	if (!d)
+		return 0;
+
+	while ((entry = readdir(d)))
+	{
+		len = strlen(entry->d_name);
+		if (len <= strlen(SESSION_SUFFIX) || strcmp(entry->d_name + len - strlen(SESSION_SUFFIX), SESSION_SUFFIX))
+			continue;
+
+		if (count == size) {
+			size = size ? size*2 : 16;
+			*names = realloc(*names, size*sizeof(**names));
+			if (!*names) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		(*names)[count] = malloc(len+1);
+		strcpy((*names)[count], entry->d_name);
+		++count;
+	}
+
+	closedir(d);
+
+	qsort(*names, count, sizeof(**names), compare_names);
+
+	return count;
+}
+
+static void
+free_names (char** names, size_t count)
+{
+	while (count > 0)
+		free(names[--count]);
+	free(names);
+}
+
+int
+session_save (session_t* session, size_t field_bytes)
+{
+	const char* dir = session_dir();
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	struct session_header header;
+	char pad[8] = {0};
+	char** names;
+	const char* env;
+	size_t count, strings_length, max = (size_t)SESSION_MAX << 20;
+	int n;
+	FILE* fd;
+
+	// Output as large as that spilled to disk isn’t copied again
+	if ((env = getenv("PLS_SESSION_MAX")) && *env)
+		max = strtoul(env, NULL, 10) << 20;
+	if (!dir || max == 0 || session->output_size > max)
+		return 0;
+
+	strings_length = strlen(session->cwd) + 1 + strlen(session->command) + 1;
+	for (n = 0; n < session->path_count; ++n)
+		strings_length += strlen(session->paths[n]) + 1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+	header.field_bytes = field_bytes;
+	header.time = session->time;
+	header.output_size = session->output_size;
+	header.field_count = session->field_count;
+	header.strings_length = strings_length;
+	header.path_count = session->path_count;
+
+	// Zero padded times sort in order
+	snprintf(path, sizeof(path), "%s/%012lld-%d" SESSION_SUFFIX, dir, (long long)session->time, (int)getpid());
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	if (!(fd = fopen(tmp, "wb")))
+		return 0;
+
+	fwrite(&header, sizeof(header), 1, fd);
+	fwrite(session->cwd, strlen(session->cwd) + 1, 1, fd);
+	fwrite(session->command, strlen(session->command) + 1, 1, fd);
+	for (n = 0; n < session->path_count; ++n)
+		fwrite(session->paths[n], strlen(session->paths[n]) + 1, 1, fd);
+	fwrite(pad, ALIGN(strings_length) - strings_length, 1, fd);
+	fwrite(session->fields, field_bytes, session->field_count, fd);
+	fwrite(session->output, 1, session->output_size, fd);
+	fwrite(pad, 1, 1, fd);
+
+	if (ferror(fd) | fclose(fd) || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return 0;
+	}
+
+	count = session_names(dir, &names);
+	for (n = SESSION_COUNT; (size_t)n < count; ++n)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, names[n]);
+		unlink(path);
+	}
+	free_names(names, count);
+
+	return 1;
+}
+
+// The string after s, or NULL if s runs past end unterminated
+static const char*
+next_string (const char* s, const char* end)
+{
+	const char* nul;
+
+	if (!s || !(nul = memchr(s, '\0', end - s)))
+		return NULL;
+	return nul + 1;
+}
+
+// A field_bytes of 0 accepts fields of any size
+static int
+session_map (session_t* session, const char* path, size_t field_bytes)
+{
+	struct session_header header;
+	struct stat st;
+	const char* s;
+	const char* end;
+	size_t strings_offset = sizeof(header);
+	size_t fields_offset, output_offset, size;
+	uint32_t n;
+	int fd;
+
+	memset(session, 0, sizeof(*session));
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header) ||
+	    read(fd, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(header.magic, SESSION_MAGIC, sizeof(header.magic)) != 0 ||
+	    (field_bytes && header.field_bytes != field_bytes)) {
+		close(fd);
+		return 0;
+	}
+
+	// Each part is checked against what's left before it's added on, so
+	// a damaged header can't wrap an offset around
+	size = st.st_size - strings_offset;
+	fields_offset = strings_offset + ALIGN(header.strings_length);
+	if (header.field_bytes == 0 || ALIGN(header.strings_length) > size ||
+	    header.field_count > (size -= ALIGN(header.strings_length)) / header.field_bytes ||
+	    header.output_size >= (size -= header.field_count * header.field_bytes) ||
+	    header.output_size + 1 != size) {
+		close(fd);
+		return 0;
+	}
+	output_offset = fields_offset + header.field_count * header.field_bytes;
+
+	session->map_size = st.st_size;
+	session->map = mmap(NULL, session->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (session->map == MAP_FAILED) {
+		session->map = NULL;
+		return 0;
+	}
+
+	// Every string, and the output, must end in a NUL inside the mapping
+	s = (const char*)session->map + strings_offset;
+	end = s + header.strings_length;
+	if (header.path_count > header.strings_length ||
+	    ((const char*)session->map)[session->map_size-1] != '\0' ||
+	    !(session->paths = calloc(header.path_count + 1, sizeof(*session->paths)))) {
+		session_close(session);
+		return 0;
+	}
+
+	session->time = header.time;
+	session->cwd = s;
+	s = next_string(s, end);
+	session->command = s;
+	s = next_string(s, end);
+
+	session->path_count = header.path_count;
+	for (n = 0; n < header.path_count && s; ++n)
+	{
+		session->paths[n] = s;
+		s = next_string(s, end);
+	}
+	if (!s) {
+		session_close(session);
+		return 0;
+	}
+
+	session->fields = (const char*)session->map + fields_offset;
+	session->field_count = header.field_count;
+	session->output = (const char*)session->map + output_offset;
+	session->output_size = header.output_size;
+
+	return 1;
+}
+
+int
+session_open (session_t* session, int index, size_t field_bytes)
+{
+	const char* dir = session_dir();
+	char path[PATH_MAX];
+	char** names;
+	size_t count;
+	int found = 0;
+
+	if (!dir || index < 1)
+		return 0;
+
+	count = session_names(dir, &names);
+	if ((size_t)index <= count) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[index-1]);
+		found = session_map(session, path, field_bytes);
+	}
+	free_names(names, count);
+
+	return found;
+}
+
+int
+session_find (session_t* session, const char* cwd, const char* command, size_t field_bytes)
+{
+	const char* dir = session_dir();
+	char path[PATH_MAX];
+	char** names;
+	size_t count, n;
+	int found = 0;
+
+	if (!dir)
+		return 0;
+
+	count = session_names(dir, &names);
+	for (n = 0; n < count && !found; ++n)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, names[n]);
+		if (!session_map(session, path, field_bytes))
+			continue;
+
+		found = strcmp(session->cwd, cwd) == 0 && strcmp(session->command, command) == 0;
+		if (!found)
+			session_close(session);
+	}
+	free_names(names, count);
+
+	return found;
+}
+
+void
+session_close (session_t* session)
+{
+	if (session->map)
+		munmap(session->map, session->map_size);
+	free(session->paths);
+	memset(session, 0, sizeof(*session));
+}
+
+void
+session_list (FILE* out)
+{
+	const char* dir = session_dir();
+	char path[PATH_MAX], date[32];
+	session_t session;
+	char** names;
+	size_t count, n;
+
+	if (!dir)
+		return;
+
+	count = session_names(dir, &names);
+	for (n = 0; n < count; ++n)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, names[n]);
+
+		// Any field size will do, as we only want the metadata
+		if (!session_map(&session, path, 0))
+			continue;
+
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&session.time));
+		fprintf(out, "%2zu  %s  %-6zu  %s  %s\n", n+1, date, session.field_count, session.cwd, session.command);
+		session_close(&session);
+	}
+	free_names(names, count);
+}
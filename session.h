@@ -0,0 +1,44 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdio.h>
+#include <time.h>
+
+#define SESSION_COUNT 10 // sessions kept in the cache
+#define SESSION_MAX 64   // megabytes of output beyond which a run isn’t kept
+
+// A captured run: its output and matched fields, with where and how it ran.
+// Sessions are cached as one file each, and mapped rather than read back.
+typedef struct {
+	time_t time;
+	const char* cwd;
+	const char* command;
+	const char** paths;    // search paths given with -p, then from the git index
+	int path_count;
+
+	const char* output;    // followed by a NUL
+	size_t output_size;
+
+	const void* fields;    // an array of field_bytes sized records
+	size_t field_count;
+
+	// (private)
+	void* map;
+	size_t map_size;
+} session_t;
+
+// Writes the session to the cache, dropping the oldest beyond SESSION_COUNT.
+// Returns 0 without writing if the output is over $PLS_SESSION_MAX
+// megabytes (SESSION_MAX by default), or that’s 0.
+int session_save (session_t* session, size_t field_bytes);
+
+// Maps a cached session, counting back from 1 for the most recent
+int session_open (session_t* session, int index, size_t field_bytes);
+void session_close (session_t* session);
+
+// Maps the most recent cached session of a command run in cwd
+int session_find (session_t* session, const char* cwd, const char* command, size_t field_bytes);
+
+void session_list (FILE* out);
+
+#endif
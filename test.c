@@ -1,9 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "parse.h"
 #include "editor.h"
 #include "input.h"
+#include "filter.h"
+#include "width.h"
+#include "ansi.h"
+#include "session.h"
+#include "report.h"
+#include "scan.h"
+#include "decompress.h"
+#include "gitindex.h"
+#include "preview.h"
+#include "daemon.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #define assert_zu(a, b) if(a != b){ fprintf(stderr, "FAILURE (line %d): '%zu' != '%zu' (" #a " != " #b ")\n", __LINE__, (size_t)a, (size_t)b); exit(1); }
 #define assert_str(a, b) if(0 != strcmp(a, b)){ fprintf(stderr, "FAILURE (line %d): '%s' != '%s'\n", __LINE__, a, b); exit(1); }
@@ -12,7 +28,7 @@
 
 #define assert_cmd(format, result, field) \
 	strcpy(cmd, format); \
-	format_cmd(cmd, str, &field, NULL); \
+	assert(format_cmd(cmd, sizeof(cmd), str, &field, NULL)); \
 	assert_str(cmd, result);
 
 #define assert_skipped_sequence(seq) \
@@ -47,10 +63,17 @@ test_replace ()
 	replace(buf, "%s", s+2, 9);
 	replace(buf, "%d", s+13, 2);
 	assert_str(buf, "subl foobar.js:13");
+
+	// No limit beyond the size of the buffer
+	memset(buf, 'x', 300);
+	strcpy(buf+300, " %d");
+	replace(buf, "%d", s+13, 2);
+	assert_zu(strlen(buf), 303);
+	assert_str(buf+300, " 13");
 }
 
 void
-input_file (input_t* in, const char* filename, int width)
+input_file (input_t* in, const char* filename)
 {
 	FILE* fd = fopen(filename, "r");
 	if(!fd)
@@ -59,7 +82,7 @@ input_file (input_t* in, const char* filename, int width)
 		exit(1);
 	}
 	input_init(in);
-	while (input_read(in, fileno(fd), width, 0))
+	while (input_read(in, fileno(fd)))
 		;
 	fclose(fd);
 }
@@ -67,7 +90,7 @@ input_file (input_t* in, const char* filename, int width)
 void
 assert_line_length (char* s, int n, int width)
 {
-	const char* next_line = find_next_line(s, width);
+	const char* next_line = find_next_line(s, s+strlen(s), width);
 	assert(next_line);
 	assert_zu((next_line - s), n);
 }
@@ -85,6 +108,13 @@ test_lines ()
 
 	assert_consumed("\033[1m");
 	assert_consumed("\033[1;2m");
+	assert_consumed("\033[?25l");
+	assert_consumed("\033[38;5;196m");
+	assert_consumed("\033]8;;http://example.com\033\\");
+	assert_consumed("\033]0;title\007");
+	assert_consumed("\033(B");
+	assert_consumed("\033=");
+	assert_line_length("\033[1\nm", 4, 80);
 
 	assert_line_length("foo\nbar",  4, 80);
 	assert_line_length("\nbar",     1, 80);
@@ -92,21 +122,128 @@ test_lines ()
 
 	assert_skipped_sequence("\033[1m");
 
-	input_file(&in, "samples/errors.log", 80);
+	// Multi-byte characters take one column, or two for wide ones
+	assert_line_length("h\xc3\xa9llo", 3, 2);
+	assert_line_length("\xe2\x94\x80\xe2\x94\x80\xe2\x94\x80", 6, 2);
+	assert_line_length("\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e", 6, 4);
+	assert_line_length("a\xe6\x97\xa5" "b", 1, 2);
+	assert_line_length("e\xcc\x81tc", 4, 2);
+
+	// Tabs move to the next tab stop
+	assert_line_length("a\tbc", 3, 9);
+	assert_line_length("abcd\tefghijkl", 7, 10);
+
+	// A newline straight after a full line doesn’t start another one
+	assert_line_length("abcd\nefg", 5, 4);
+	assert_line_length("abcd\033[0m\nefg", 9, 4);
+
+	// Incomplete sequences wait for more input
+	assert(NULL == find_next_line("ab\xe6\x97", "ab\xe6\x97"+4, 80));
+	assert(NULL == find_next_line("abcd", "abcd"+4, 4));
+
+	assert_zu(codepoint_width('a'), 1);
+	assert_zu(codepoint_width(0x301), 0);
+	assert_zu(codepoint_width(0x2500), 1);
+	assert_zu(codepoint_width(0x65e5), 2);
+	assert_zu(codepoint_width(0x1F600), 2);
+
+	assert_zu(ascii_span("plain ascii text here", "plain ascii text here"+21, 80), 21);
+	assert_zu(ascii_span("plain ascii text here", "plain ascii text here"+21, 10), 10);
+	assert_zu(ascii_span("plain ascii\ttext", "plain ascii\ttext"+16, 80), 11);
+	assert_zu(ascii_span("plain \xc3\xa9", "plain \xc3\xa9"+8, 80), 6);
+
+	input_file(&in, "samples/errors.log");
 	assert_zu(in.nlines, 10);
-	assert(in.line_offsets[3] == 22);
+	assert_zu(input_line_offset(&in, 3), 22);
+	assert_zu(input_rows(&in, 3, 80), 1);
+	assert_zu(input_rows(&in, 3, 10), 3);
+	assert_zu(input_rows(&in, 10, 10), 0);
 	input_free(&in);
 
-	input_file(&in, "samples/errors.log", 10);
-	assert_zu(in.nlines, 21);
-	assert(in.line_offsets[3] == 21);
+	// Wrapping depends only on the width we lay out for
+	size_t rows[100];
+	input_file(&in, "samples/errors.log");
+	assert_zu(input_layout(&in, 0, 80, 100, rows), 10);
+	assert_zu(rows[3], 22);
+	assert_zu(input_layout(&in, 0, 10, 100, rows), 21);
+	assert_zu(rows[3], 21);
+	assert_zu(rows[21], in.nmemb);
+	assert_zu(input_rows_back(&in, 10, 100), 21);
+	assert_zu(input_rows_back(&in, 10, 5), 5);
+
+	// The selected row is centred where possible
+	assert_zu(input_layout(&in, 136, 10, 4, rows), 4);
+	assert(rows[0] <= 136 && 136 < rows[4]);
+	assert_zu(rows[2], 131);
+
+	// Or the last rows, to follow the end of the output
+	assert_zu(input_layout_tail(&in, 10, 4, rows), 4);
+	assert_zu(rows[4], in.nmemb);
+	input_free(&in);
+
+	input_init(&in);
+	input_append(&in, "a\nb\nc", 5);
+	assert_zu(input_layout_tail(&in, 80, 2, rows), 2);
+	assert_zu(rows[0], 2);
+	input_append(&in, "\n", 1);
+	assert_zu(input_layout_tail(&in, 80, 2, rows), 2);
+	assert_zu(rows[0], 2);
+	assert_zu(rows[2], 6);
+	input_free(&in);
+
+	// A long line being added to is wrapped on from the last frame's mark,
+	// ending up where it would be wrapped from its start
+	input_mark_t mark = { 0, 0, 0 };
+	size_t n, tail;
+	input_init(&in);
+	input_append(&in, "short\n", 6);
+	for (n = 0; n < 50; ++n)
+	{
+		input_append(&in, "abcdefg ", 8);
+		tail = input_tail_mark(&in, 10, 3, &mark, rows);
+		assert_zu(tail, input_tail(&in, 10, rows[0]));
+		assert(rows[0] == 3 || (n < 3 && rows[0] < 3));
+	}
+	assert_zu(mark.line, 1);
+	assert(mark.offset > 300);
+	input_append(&in, "\nx", 2);
+	assert_zu(input_tail_mark(&in, 10, 3, &mark, rows), input_tail(&in, 10, 3));
 	input_free(&in);
 
-	input_file(&in, "samples/testing-big.txt", 80);
+	input_file(&in, "samples/testing-big.txt");
+	assert(find_line_index(&in, 0)  == 0);
 	assert(find_line_index(&in, 1)  == 1);
 	assert(find_line_index(&in, 3)  == 1);
 	assert(find_line_index(&in, 64) == 6);
-	assert(find_line_index(&in, 531) == 17);
+	assert(find_line_index(&in, 531) == 12);
+	assert_zu(input_rows(&in, 12, 80), 9);
+	assert_zu(input_layout(&in, 531, 80, 3, rows), 3);
+	assert_zu(rows[1], 507);
+	input_free(&in);
+
+	// Past the threshold, output moves to a file without changing
+	size_t i;
+	char line[32];
+	input_init(&in);
+	in.spill_at = 16384;
+	for (i = 0; i < 2000; ++i) {
+		snprintf(line, sizeof(line), "line %zu\n", i);
+		input_append(&in, line, strlen(line));
+	}
+	assert(in.spill >= 0);
+	assert_zu(in.nlines, 2000);
+	assert_zu(find_line_index(&in, input_line_offset(&in, 1999)), 1999);
+	assert(strncmp(in.v + input_line_offset(&in, 1234), "line 1234\n", 10) == 0);
+	assert(in.v[in.nmemb] == '\0');
+
+	// Each line read notes when it ended
+	assert(input_line_time(&in, 0) >= 0);
+	assert(input_line_time(&in, 1999) >= input_line_time(&in, 0));
+	assert(input_line_time(&in, 2000) == -1);
+	input_free(&in);
+
+	input_attach(&in, "a\nb\n", 4);
+	assert(input_line_time(&in, 0) == -1);
 	input_free(&in);
 }
 
@@ -132,6 +269,12 @@ test_parse ()
 
 	assert_cmd("vim +'call cursor(%d, %d)'", "vim +'call cursor(16, 0)' foobar.js", field_offsets[0]);
 
+	// Matched without the colour sequences, but offsets are into the original
+	assert_field(field_offsets[1].path, "pls.c");
+	assert_field(field_offsets[1].line, "125");
+	assert_field(field_offsets[1].column, "18");
+	assert_zu(field_offsets[1].match.start, (size_t)(strchr(str, 'p') - str));
+
 	assert_field(field_offsets[2].path, "foobar.js");
 	assert_field(field_offsets[2].line, "14");
 	assert_field(field_offsets[2].column, "6");
@@ -139,11 +282,53 @@ test_parse ()
 	assert_cmd("subl %s:%d", "subl foobar.js:14", field_offsets[2]);
 	assert_cmd("vim +%d",    "vim +14 foobar.js", field_offsets[2]);
 	assert_cmd("vim +'call cursor(%d, %d)'", "vim +'call cursor(14, 6)' foobar.js", field_offsets[2]);
+
+	// A command that won’t fit is refused, rather than overflowing
+	strcpy(cmd, "vim +%d");
+	assert(!format_cmd(cmd, 17, str, &field_offsets[2], NULL));
+	strcpy(cmd, "vim +%d");
+	assert(format_cmd(cmd, 18, str, &field_offsets[2], NULL));
+	assert_str(cmd, "vim +14 foobar.js");
+
+	{
+		char* words[] = { "vim", "+call cursor(%d, %d)" };
+		char* subl[] = { "subl", "%s:%d:%d", "-w" };
+		char** argv;
+
+		argv = format_argv(words, 2, str, &field_offsets[2], NULL);
+		assert_str(argv[1], "+call cursor(14, 6)");
+		assert_str(argv[2], "foobar.js");
+		assert(argv[3] == NULL);
+		free_argv(argv);
+
+		argv = format_argv(subl, 3, str, &field_offsets[2], "src dir");
+		assert_str(argv[1], "src dir/foobar.js:14:6");
+		assert_str(argv[2], "-w");
+		assert(argv[3] == NULL);
+		free_argv(argv);
+
+		{
+			char* mate[] = { "mate", "-w", "--line", "%d:%d" };
+			const struct field_t* fields[] = { &field_offsets[2], &field_offsets[1] };
+			const char* dirs[] = { NULL, "lib" };
+
+			argv = format_argv_each(mate, 4, str, fields, dirs, 2);
+			assert_str(argv[1], "-w");
+			assert_str(argv[2], "--line");
+			assert_str(argv[3], "14:6");
+			assert_str(argv[4], "foobar.js");
+			assert_str(argv[5], "--line");
+			assert(strncmp(argv[7], "lib/", 4) == 0);
+			assert(argv[8] == NULL);
+			free_argv(argv);
+		}
+	}
 }
 
 void
 test_editor ()
 {
+	char huge[BUFSIZ + 1];
 	char* cmd;
 
 	assert(is_named_executable("foo", "foo"));
@@ -168,6 +353,776 @@ test_editor ()
 	setenv("PLS", "Foo bar", 1);
 	cmd = editor_command();
 	assert_str(cmd, "Foo bar");
+
+	memset(huge, 'x', BUFSIZ);
+	huge[BUFSIZ] = '\0';
+	setenv("PLS", huge, 1);
+	assert(!editor_command());
+	unsetenv("PLS");
+}
+
+void
+test_filter ()
+{
+	filter_t filter;
+	const char* paths[] = { "src/net/Socket.c", "src/ui/draw.c", "lib/net.h", "src/net/dns.c" };
+	size_t i;
+
+	filter_init(&filter);
+	for (i = 0; i < sizeof(paths)/sizeof(*paths); ++i)
+		filter_add(&filter, paths[i], strlen(paths[i]));
+
+	assert_zu(filter.nresults, 4);
+
+	assert_zu(filter_update(&filter, "s", 1), 3);
+	assert_zu(filter_update(&filter, "src/", 4), 3);
+	assert_zu(filter_update(&filter, "src/NET", 7), 2);
+	assert_zu(filter.results[0], 0);
+	assert_zu(filter.results[1], 3);
+	assert_zu(filter_update(&filter, "net", 3), 3);
+	assert_zu(filter_update(&filter, "xyz", 3), 0);
+	assert_zu(filter_update(&filter, "", 0), 4);
+
+	filter.fuzzy = 1;
+	assert_zu(filter_update(&filter, "snd", 3), 1);
+	assert_zu(filter.results[0], 3);
+	assert_zu(filter_update(&filter, "sc", 2), 3);
+
+	// Keys added later are checked against the current query
+	filter_add(&filter, "misc.c", 6);
+	assert_zu(filter.nresults, 4);
+	filter_add(&filter, "README", 6);
+	assert_zu(filter.nresults, 4);
+
+	filter_free(&filter);
+}
+
+void
+test_ansi ()
+{
+	shadow_t shadow;
+	const char* raw = "\033[1mfoo.c:1:\033[0m \033]8;;file:///bar\033\\bar.c\033]8;;\033\\:2\n";
+	const char* clean = "foo.c:1: bar.c:2\n";
+	size_t n;
+
+	shadow_init(&shadow);
+	ansi_strip(&shadow, raw, strlen(raw));
+	assert_str(shadow.v, clean);
+
+	for (n = 0; n < strlen(clean); ++n)
+		assert_zu(raw[shadow_raw_start(&shadow, n)], clean[n]);
+
+	assert_zu(shadow_raw_stop(&shadow, 5), 9);  // just past "foo.c"
+	shadow_free(&shadow);
+
+	// Sequences split between reads
+	shadow_init(&shadow);
+	for (n = 0; n < strlen(raw); ++n)
+		ansi_strip(&shadow, raw+n, 1);
+	assert_str(shadow.v, clean);
+	for (n = 0; n < strlen(clean); ++n)
+		assert_zu(raw[shadow_raw_start(&shadow, n)], clean[n]);
+	shadow_free(&shadow);
+
+	// A newline ends an unterminated sequence
+	shadow_init(&shadow);
+	ansi_strip(&shadow, "a\033]8;;oops\nb", 12);
+	assert_str(shadow.v, "a\nb");
+	shadow_free(&shadow);
+}
+
+size_t
+seq_step (size_t n)
+{
+	// Mostly short lines, with blocks needing 32 and 64-bit deltas
+	if (n == 500)
+		return (size_t)1 << 33;
+	if (n % 97 == 0)
+		return 100000;
+	return n % 7;
+}
+
+void
+test_seq ()
+{
+	seq_t seq;
+	size_t n, found, value = 0;
+
+	seq_init(&seq);
+	for (n = 0; n < 1000; ++n)
+	{
+		seq_push(&seq, value);
+		value += seq_step(n);
+	}
+
+	assert_zu(seq.count, 1000);
+	for (n = 0, value = 0; n < 1000; ++n)
+	{
+		assert_zu(seq_get(&seq, n), value);
+
+		// The last entry with the value, for repeated ones
+		found = seq_find(&seq, value);
+		assert_zu(seq_get(&seq, found), value);
+		assert(found+1 == seq.count || seq_get(&seq, found+1) > value);
+		assert(found >= n);
+
+		value += seq_step(n);
+	}
+	assert_zu(seq_find(&seq, (size_t)-1), 999);
+
+	seq_free(&seq);
+}
+
+// Output is stripped of escape sequences in chunks, with offsets still into
+// the whole of it
+void
+test_study_chunks ()
+{
+	const char* match = "\033[1mfoo.c:12:\033[0m error\n";
+	const size_t length = 3*STUDY_CHUNK;
+	pattern_list_t patterns;
+	char* str = malloc(length + 1);
+	size_t n, at;
+
+	init_patterns(&patterns);
+	add_default_patterns(&patterns);
+
+	assert(str);
+	for (n = 0; n < length; ++n)
+		str[n] = n % 80 == 79 ? '\n' : '-';
+	str[length] = '\0';
+
+	// One in each chunk, and one across the edge of the first
+	for (n = 0; n < 3; ++n)
+	{
+		at = n*STUDY_CHUNK + (n == 0 ? STUDY_CHUNK - 10 : 200) - 1;
+		at -= at % 80;
+		memcpy(str + at, match, strlen(match));
+	}
+
+	assert(study(&patterns, str, length, 0));
+	assert_zu(field_count, 3);
+	for (n = 0; n < 3; ++n)
+	{
+		assert_field(field_offsets[n].path, "foo.c");
+		assert_field(field_offsets[n].line, "12");
+	}
+
+	free(str);
+}
+
+// The same diagnostic hashes the same from run to run, but not another
+void
+test_field_hash ()
+{
+	const char* outputs[] = {
+		"a.c:3:1: warning: unused x [took 12ms]\n",
+		"\033[1ma.c:3:1:\033[0m  warning: unused x [took 7ms]\n",
+		"a.c:3:1: warning: unused y [took 12ms]\n",
+		"a.c:4:1: warning: unused x [took 12ms]\n",
+	};
+	uint64_t hashes[4];
+	pattern_list_t patterns;
+	size_t n;
+
+	init_patterns(&patterns);
+	add_default_patterns(&patterns);
+
+	for (n = 0; n < 4; ++n)
+	{
+		assert(study(&patterns, outputs[n], strlen(outputs[n]), 0));
+		assert_zu(field_count, 1);
+		hashes[n] = field_hash(outputs[n], strlen(outputs[n]), &field_offsets[0]);
+	}
+
+	assert(hashes[0] == hashes[1]);
+	assert(hashes[0] != hashes[2]);
+	assert(hashes[0] != hashes[3]);
+}
+
+void
+test_session ()
+{
+	char dir[64];
+	session_t session;
+	const char* paths[] = { "src", "lib" };
+	size_t fields[] = { 1, 2, 3, 4 };
+	int n;
+
+	sprintf(dir, "/tmp/pls-test-%d", (int)getpid());
+	setenv("PLS_CACHE", dir, 1);
+
+	for (n = 0; n < SESSION_COUNT + 2; ++n)
+	{
+		memset(&session, 0, sizeof(session));
+		session.time = 1000 + n;
+		session.cwd = "/work";
+		session.command = n % 2 ? "make" : "make test";
+		session.paths = paths;
+		session.path_count = 2;
+		session.output = "foo.c:1: error\n";
+		session.output_size = strlen(session.output);
+		session.fields = fields;
+		session.field_count = 2;
+		assert(session_save(&session, 2*sizeof(size_t)));
+	}
+
+	// Saving can be turned off
+	setenv("PLS_SESSION_MAX", "0", 1);
+	session.time = 2000;
+	assert(!session_save(&session, 2*sizeof(size_t)));
+	unsetenv("PLS_SESSION_MAX");
+
+	assert(session_open(&session, 1, 2*sizeof(size_t)));
+	assert_zu(session.time, 1000 + SESSION_COUNT + 1);
+	assert_str(session.cwd, "/work");
+	assert_str(session.command, "make");
+	assert_zu(session.path_count, 2);
+	assert_str(session.paths[1], "lib");
+	assert_zu(session.field_count, 2);
+	assert_zu(((const size_t*)session.fields)[3], 4);
+	assert_str(session.output, "foo.c:1: error\n");
+	session_close(&session);
+
+	// Only the most recent are kept
+	assert(session_open(&session, SESSION_COUNT, 2*sizeof(size_t)));
+	assert_zu(session.time, 1002);
+	session_close(&session);
+	assert(!session_open(&session, SESSION_COUNT+1, 2*sizeof(size_t)));
+
+	// Fields of a different size aren’t read back
+	assert(!session_open(&session, 1, sizeof(size_t)));
+
+	// The last run of a command where it ran
+	assert(session_find(&session, "/work", "make test", 2*sizeof(size_t)));
+	assert_zu(session.time, 1000 + SESSION_COUNT);
+	session_close(&session);
+	assert(!session_find(&session, "/home", "make test", 2*sizeof(size_t)));
+	assert(!session_find(&session, "/work", "make", sizeof(size_t)));
+
+	// Damaged files are refused: strings without their NULs, and output
+	// without the one after it
+	for (n = 1; n <= 2; ++n)
+	{
+		char path[128];
+		FILE* f;
+		sprintf(path, "%s/%012d-%d.pls", dir, 1000 + SESSION_COUNT + 2 - n, (int)getpid());
+		assert((f = fopen(path, "r+")));
+		if (n == 1) {
+			fseek(f, 40, SEEK_SET);
+			fputs("xxxxxxxxxxxxxxxxxxxxxxxx", f);
+		} else {
+			fseek(f, -1, SEEK_END);
+			fputc('x', f);
+		}
+		fclose(f);
+		assert(!session_open(&session, n, 2*sizeof(size_t)));
+	}
+
+	for (n = 1; n <= SESSION_COUNT; ++n)
+	{
+		char path[128];
+		sprintf(path, "%s/%012d-%d.pls", dir, 1000 + SESSION_COUNT + 2 - n, (int)getpid());
+		assert(0 == unlink(path));
+	}
+	assert(0 == rmdir(dir));
+	unsetenv("PLS_CACHE");
+}
+
+void
+test_report ()
+{
+	char buf[BUFSIZ] = {0};
+	FILE* out = tmpfile();
+	report_t report;
+
+	memset(&report, 0, sizeof(report));
+	report.path = "a b.c:3";
+	report.path_length = 5;
+	report.line = 3;
+	report.pattern = 1;
+	report.offset = 42;
+	report.message = "\"x\"\001";
+	report.message_length = 4;
+
+	report_begin(out, REPORT_JSON);
+	report_match(out, REPORT_JSON, &report);
+	report_end(out, REPORT_JSON);
+
+	report.resolved = "/src/a b.c";
+	report.column = 7;
+	report_begin(out, REPORT_QUICKFIX);
+	report_match(out, REPORT_QUICKFIX, &report);
+	report_end(out, REPORT_QUICKFIX);
+
+	rewind(out);
+	fread(buf, 1, sizeof(buf)-1, out);
+	fclose(out);
+
+	assert_str(buf,
+		"{\"path\":\"a b.c\",\"line\":3,\"column\":null,\"resolved\":null,"
+		"\"pattern\":1,\"offset\":42,\"message\":\"\\\"x\\\"\\u0001\"}\n"
+		"/src/a b.c:3:7: \"x\"\001\n");
+
+	assert(report_format("sarif") == REPORT_SARIF);
+	assert(report_format("xml") == REPORT_NONE);
+}
+
+static void
+scan_count (scan_t* scan, struct scan_chunk* chunk, void* data)
+{
+	const char* s = scan->sources[chunk->source].v;
+	size_t i, n = 0;
+
+	(void)data;
+	for (i = chunk->start; i < chunk->stop; ++i)
+		n += s[i] == '\n';
+	chunk->result = (void*)n;
+}
+
+static void
+scan_total (scan_t* scan, struct scan_chunk* chunk, void* data)
+{
+	size_t* total = data;
+
+	// In order, and only once worked
+	assert(chunk == scan->chunks || chunk[-1].result == NULL);
+	total[0] += (size_t)chunk->result;
+	++total[1];
+	chunk->result = NULL;
+}
+
+void
+test_scan ()
+{
+	char dir[64], path[128];
+	size_t total[2] = { 0, 0 };
+	scan_t scan;
+	FILE* fd;
+	int i;
+
+	sprintf(dir, "/tmp/pls-scan-%d", (int)getpid());
+	assert(0 == mkdir(dir, 0700));
+	sprintf(path, "%s/sub", dir);
+	assert(0 == mkdir(path, 0700));
+
+	// One file of several chunks, and two small ones
+	sprintf(path, "%s/sub/b.log", dir);
+	fd = fopen(path, "w");
+	for (i = 0; i < 3*SCAN_CHUNK/64; ++i)
+		fprintf(fd, "%063d\n", i);
+	fclose(fd);
+	sprintf(path, "%s/a.log", dir);
+	fd = fopen(path, "w");
+	fputs("a.c:1: one\nno newline", fd);
+	fclose(fd);
+	sprintf(path, "%s/.hidden", dir);
+	fd = fopen(path, "w");
+	fputs("\n", fd);
+	fclose(fd);
+
+	scan_init(&scan);
+	assert(!scan_add(&scan, dir, 0));
+	assert(scan_add(&scan, dir, 1));
+	assert_zu(scan.nsources, 2);
+	assert(strstr(scan.sources[0].path, "/a.log"));
+	assert(strstr(scan.sources[1].path, "/sub/b.log"));
+	assert_zu(scan.nchunks, 4);
+	assert_zu(scan.chunks[1].start, 0);
+	assert(scan.sources[1].v[scan.chunks[2].start-1] == '\n');
+
+	scan_run(&scan, scan_count, scan_total, total);
+	assert_zu(total[0], 1 + 3*SCAN_CHUNK/64);
+	assert_zu(total[1], 4);
+	scan_free(&scan);
+
+	sprintf(path, "rm -r %s", dir);
+	assert(0 == system(path));
+}
+
+void
+test_decompress ()
+{
+	const char* text = "foo.c:1: error\nbar.c:2: warning\n";
+	unsigned char gz[2*BUFSIZ];
+	size_t n, size;
+	char* out;
+	z_stream z;
+	int fds[2];
+
+	memset(&z, 0, sizeof(z));
+	assert(deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+	z.next_in = (unsigned char*)text;
+	z.avail_in = strlen(text);
+	z.next_out = gz;
+	z.avail_out = BUFSIZ;
+	assert(deflate(&z, Z_FINISH) == Z_STREAM_END);
+	n = BUFSIZ - z.avail_out;
+	deflateEnd(&z);
+
+	// Two members one after the other
+	memcpy(gz + n, gz, n);
+
+	assert(compression((char*)gz, n) == COMPRESSION_GZIP);
+	assert(compression(text, strlen(text)) == COMPRESSION_NONE);
+
+	assert(decompress_buffer((char*)gz, 2*n, &out, &size));
+	assert_zu(size, 2*strlen(text));
+	assert(0 == strncmp(out, text, strlen(text)));
+	assert_str(out + strlen(text), text);
+	free(out);
+
+	assert(!decompress_buffer((char*)gz, n - 4, &out, &size));
+	free(out);
+
+	// Through the decompressing thread
+	assert(0 == pipe(fds));
+	assert(write(fds[1], gz, n) == (ssize_t)n);
+	close(fds[1]);
+	{
+		char peek[DECOMPRESS_PEEK], buf[BUFSIZ] = {0};
+		int fd = decompress_fd(fds[0], peek, &n);
+		ssize_t r;
+		size = 0;
+		assert(fd != fds[0]);
+		assert_zu(n, 0);
+		while ((r = read(fd, buf + size, sizeof(buf) - size - 1)) > 0)
+			size += r;
+		assert_str(buf, text);
+		close(fd);
+	}
+	close(fds[0]);
+}
+
+// Appends an index entry for a file, with the name compressed against the
+// previous one for version 4
+size_t
+index_entry (char* s, size_t n, int version, const char* name, const char* previous)
+{
+	size_t start = n, length = strlen(name), common = 0;
+
+	memset(s + n, 0, 62);
+	s[n+26] = (char)0x81; // mode 0100644
+	s[n+27] = (char)0xa4;
+	s[n+60] = length >> 8;
+	s[n+61] = length & 0xff;
+	n += 62;
+
+	if (version == 4) {
+		while (name[common] && name[common] == previous[common])
+			++common;
+		s[n++] = strlen(previous) - common;
+	}
+	strcpy(s + n, name + common);
+	n += length - common + 1;
+
+	if (version != 4)
+		n = start + ((62 + length + 8) & ~7);
+	return n;
+}
+
+void
+test_gitindex ()
+{
+	const char* names[] = { "lib/a.c", "src/a.c", "src/test/sample.js", "test/b.c" };
+	gitindex_t index;
+	const char* file;
+	char s[BUFSIZ];
+	size_t n = 12, i;
+
+	memcpy(s, "DIRC\0\0\0\2\0\0\0\4", 12);
+	for (i = 0; i < 4; ++i)
+		n = index_entry(s, n, 2, names[i], "");
+
+	assert(gitindex_parse(&index, s, n, 20));
+	assert_zu(gitindex_find(&index, "sample.js", 9, &file), 1);
+	assert_str(file, "src/test/sample.js");
+	assert_zu(gitindex_find(&index, "./test/sample.js", 16, &file), 1);
+	assert_zu(gitindex_find(&index, "a.c", 3, &file), 2);
+	assert_zu(gitindex_find(&index, "src/a.c", 7, &file), 1);
+	assert_str(file, "src/a.c");
+	assert_zu(gitindex_find(&index, "c", 1, &file), 0);
+	assert_zu(gitindex_find(&index, "../a.c", 6, &file), 0);
+	assert_zu(gitindex_find(&index, "/src/a.c", 8, &file), 0);
+	gitindex_free(&index);
+
+	// The wrong hash size gives names of the wrong length
+	assert(!gitindex_parse(&index, s, n, 32));
+	assert(!gitindex_parse(&index, s, n - 8, 20));
+
+	// Version 4 names share a prefix with the one before
+	memcpy(s, "DIRC\0\0\0\4\0\0\0\4", 12);
+	for (n = 12, i = 0; i < 4; ++i)
+		n = index_entry(s, n, 4, names[i], i ? names[i-1] : "");
+
+	assert(gitindex_parse(&index, s, n, 20));
+	assert_zu(gitindex_find(&index, "test/sample.js", 14, &file), 1);
+	assert_str(file, "src/test/sample.js");
+	assert_zu(gitindex_find(&index, "b.c", 3, &file), 1);
+	assert_str(file, "test/b.c");
+	gitindex_free(&index);
+}
+
+// Writes an index of the files named to path, replacing any there
+void
+write_index (const char* path, const char** names, size_t count)
+{
+	char s[BUFSIZ], tmp[PATH_MAX];
+	size_t n = 12, i;
+	FILE* f;
+
+	memcpy(s, "DIRC\0\0\0\2\0\0\0", 11);
+	s[11] = count;
+	for (i = 0; i < count; ++i)
+		n = index_entry(s, n, 2, names[i], "");
+
+	snprintf(tmp, sizeof(tmp), "%s.lock", path);
+	f = fopen(tmp, "w");
+	assert(f);
+	fwrite(s, 1, n, f);
+	fclose(f);
+	assert(rename(tmp, path) == 0);
+}
+
+void
+test_daemon ()
+{
+	const char* names[] = { "lib/a.c", "src/a.c", "src/test/sample.js" };
+	const char* changed[] = { "src/test/other.js" };
+	char dir[64], socket_path[80], path[PATH_MAX], root[PATH_MAX], file[PATH_MAX];
+	struct timespec wait = { 0, 10000000 };
+	struct stat st;
+	daemon_t daemon;
+	pid_t pid;
+	int tries;
+
+	sprintf(dir, "/tmp/pls-test-%d", (int)getpid());
+	sprintf(socket_path, "%s/plsd.sock", dir);
+	setenv("PLS_SOCKET", socket_path, 1);
+	mkdir(dir, 0700);
+	snprintf(path, sizeof(path), "%s/repo", dir);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/repo/sub", dir);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/repo/.git", dir);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/repo/.git/index", dir);
+	write_index(path, names, 3);
+
+	// Served from another process, so that it can be stopped
+	assert(!daemon_connect(&daemon));
+	assert((pid = fork()) >= 0);
+	if (pid == 0) {
+		alarm(30);  // in case a failed test leaves it running
+		_exit(daemon_serve(socket_path) ? 0 : 1);
+	}
+	for (tries = 0; !daemon_connect(&daemon) && tries < 100; ++tries)
+		nanosleep(&wait, NULL);
+	assert(tries < 100);
+
+	// The socket is the user’s alone
+	assert(stat(socket_path, &st) == 0 && (st.st_mode & 077) == 0);
+
+	// The root comes back relative to the directory asked about
+	snprintf(path, sizeof(path), "%s/repo/sub", dir);
+	assert_zu(daemon_find(&daemon, path, "test/sample.js", 14, root, file), 1);
+	assert_str(root, "..");
+	assert_str(file, "src/test/sample.js");
+	assert_zu(daemon_find(&daemon, path, "a.c", 3, root, file), 2);
+	assert_zu(daemon_find(&daemon, path, "b.c", 3, root, file), 0);
+	assert_zu(daemon_find(&daemon, dir, "a.c", 3, root, file), 0);
+
+	// A new index is read again
+	snprintf(path, sizeof(path), "%s/repo/.git/index", dir);
+	write_index(path, changed, 1);
+	snprintf(path, sizeof(path), "%s/repo", dir);
+	assert_zu(daemon_find(&daemon, path, "other.js", 8, root, file), 1);
+	assert_str(root, ".");
+	assert_str(file, "src/test/other.js");
+	assert_zu(daemon_find(&daemon, path, "sample.js", 9, root, file), 0);
+
+	// Once plsd has gone, asking fails rather than raising SIGPIPE
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	assert(daemon_find(&daemon, path, "sample.js", 9, root, file) < 0);
+	daemon_close(&daemon);
+	unlink(socket_path);
+	snprintf(path, sizeof(path), "%s/repo/.git/index", dir);
+	assert(0 == unlink(path));
+	snprintf(path, sizeof(path), "%s/repo/.git", dir);
+	assert(0 == rmdir(path));
+	snprintf(path, sizeof(path), "%s/repo/sub", dir);
+	assert(0 == rmdir(path));
+	snprintf(path, sizeof(path), "%s/repo", dir);
+	assert(0 == rmdir(path));
+	assert(0 == rmdir(dir));
+	unsetenv("PLS_SOCKET");
+}
+
+void
+test_preview ()
+{
+	preview_t preview;
+	input_t* lines;
+	int stdin_open = fcntl(STDIN_FILENO, F_GETFD) >= 0;
+
+	preview_init(&preview);
+
+	lines = preview_file(&preview, "samples/errors.log");
+	assert(lines);
+	// Taking an empty slot leaves the descriptors alone
+	assert(stdin_open == (fcntl(STDIN_FILENO, F_GETFD) >= 0));
+	assert_zu(lines->nlines, 10);
+	assert_zu(input_line_offset(lines, 3), 22);
+
+	// Files are mapped once, however often they’re shown
+	assert(preview_file(&preview, "samples/errors.log") == lines);
+	assert_zu(preview.count, 1);
+
+	assert(!preview_file(&preview, "samples/missing.log"));
+	assert(!preview_file(&preview, "samples"));
+	assert_zu(preview.count, 1);
+
+	preview_free(&preview);
+}
+
+// Checks the native matchers against PCRE on lines made up of pieces of
+// the patterns, which are likeliest to find a difference
+void
+test_native ()
+{
+	const char* pieces[] = {
+		"a", "b", "_", "x.c", ".", "/", "-", ":", "1", "23", " ", "(", ")", ",",
+		"\"", "file: ", " line: ", "in ", " on line ", "File \"", "\", line ",
+		"\xc3\xa9", "\t", "src/", ".js", "::", "x.c:12", ":3", "f(1,2)", "(4,",
+		"5)", ",6)", "in x on line 7", "File \"a\", line 8",
+		"file: a/b.c line: 9",
+	};
+	const size_t npieces = sizeof(pieces)/sizeof(*pieces);
+	pattern_list_t natives;
+	pcre* compiled;
+	const char* error;
+	int offset, a[30], b[30], ra, rb, i, j;
+	char line[256];
+	size_t n, k, count;
+	unsigned long seed = 1;
+
+	init_patterns(&natives);
+	add_default_patterns(&natives);
+	assert(natives.count == default_pattern_count);
+
+	for (i = 0; i < default_pattern_count; ++i)
+	{
+		assert(natives.patterns[i].native);
+		compiled = pcre_compile(default_patterns[i], 0, &error, &offset, NULL);
+		assert(compiled);
+
+		for (count = 0; count < 100000; ++count)
+		{
+			for (n = 0, k = seed % 12 + 1; k > 0; --k)
+			{
+				seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+				strcpy(line + n, pieces[(seed >> 33) % npieces]);
+				n += strlen(line + n);
+			}
+
+			ra = pcre_exec(compiled, NULL, line, n, 0, 0, a, 30);
+			rb = pattern_exec(&natives.patterns[i], line, n, b, 30);
+			if (ra != rb)
+				fprintf(stderr, "FAILURE: pattern %d on '%s': %d != %d\n", i, line, ra, rb);
+			assert(ra == rb);
+			for (j = 0; j < 2*ra; ++j)
+				assert(a[j] == b[j]);
+		}
+
+		pcre_free(compiled);
+	}
+
+	// Lines from real tools
+	assert(pattern_exec(&natives.patterns[0], "src/foo.c:12:5: error", 21, b, 30) == 4);
+	assert(b[2] == 0 && b[3] == 9 && b[5] == 12 && b[7] == 14);
+	assert(pattern_exec(&natives.patterns[4], "  File \"x.py\", line 3, in f", 28, b, 30) == 3);
+	assert(b[2] == 8 && b[3] == 12);
+}
+
+// Long lines are matched in windows, which must still find matches across
+// their edges
+void
+test_windows ()
+{
+	const size_t length = 5*PATTERN_WINDOW;
+	pattern_list_t patterns;
+	char* line = malloc(length);
+	int v[30], i;
+
+	assert(line);
+	memset(line, ' ', length);
+
+	init_patterns(&patterns);
+	add_default_patterns(&patterns);
+	assert(add_pattern(&patterns, "in (.+?) on line (\\d+)"));
+
+	assert(pattern_exec(&patterns.patterns[0], line, length, v, 30) == PCRE_ERROR_NOMATCH);
+	assert(pattern_exec(&patterns.patterns[default_pattern_count], line, length, v, 30) == PCRE_ERROR_NOMATCH);
+
+	// Across the edge of the first window
+	memcpy(line + PATTERN_WINDOW - 4, "src/a.c:12", 10);
+	assert(pattern_exec(&patterns.patterns[0], line, length, v, 30) == 3);
+	assert(v[0] == PATTERN_WINDOW - 4 && v[3] == PATTERN_WINDOW + 3 && v[5] == PATTERN_WINDOW + 6);
+	memset(line + PATTERN_WINDOW - 4, ' ', 10);
+
+	// With the numbers split by the edge, which mustn’t be cut short there
+	assert(add_pattern(&patterns, "([\\w/.]+):(\\d+):(\\d+)"));
+	memcpy(line + PATTERN_WINDOW - 14, "src/foo.c:12345:67", 18);
+	for (i = 0; i < 2; ++i)
+	{
+		assert(pattern_exec(&patterns.patterns[i ? default_pattern_count+1 : 0], line, length, v, 30) == 4);
+		assert(v[2] == PATTERN_WINDOW - 14 && v[3] == PATTERN_WINDOW - 5);
+		assert(v[4] == PATTERN_WINDOW - 4 && v[5] == PATTERN_WINDOW + 1);
+		assert(v[6] == PATTERN_WINDOW + 2 && v[7] == PATTERN_WINDOW + 4);
+	}
+	memset(line + PATTERN_WINDOW - 14, ' ', 18);
+
+	// A match going on well past the window, which grows to hold it
+	assert(add_pattern(&patterns, "([\\w/.]+):(\\d+)"));
+	memcpy(line + 900, "src/a.c:", 8);
+	memset(line + 908, '1', 2*PATTERN_WINDOW);
+	assert(pattern_exec(&patterns.patterns[default_pattern_count+2], line, length, v, 30) == 3);
+	assert(v[2] == 900 && v[5] == 908 + 2*PATTERN_WINDOW);
+	memset(line + 900, ' ', 8 + 2*PATTERN_WINDOW);
+
+	// In the last window, after an unfinished match in the first
+	memcpy(line, "in ", 3);
+	memcpy(line + length - 20, "in b.php on line 7", 18);
+	assert(pattern_exec(&patterns.patterns[default_pattern_count], line, length, v, 30) == 3);
+	assert(v[2] == (int)length - 17 && v[3] == (int)length - 12 && v[4] == (int)length - 3);
+
+	// The built-in patterns aren’t windowed, and match as on the whole line
+	assert(pattern_exec(&patterns.patterns[2], line, length, v, 30) == 3);
+	assert(v[2] == 3 && v[3] == (int)length - 12);
+
+	free(line);
+}
+
+// A pattern which backtracks without end is given up on
+void
+test_quarantine ()
+{
+	const char* evil = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.go: x";
+	pattern_list_t patterns;
+	int v[30], i;
+
+	init_patterns(&patterns);
+	assert(add_pattern(&patterns, "(a|aa)+\\.go:(\\d+)"));
+	assert(pattern_exec(&patterns.patterns[0], "aa.go:3", 7, v, 30) == 3);
+
+	for (i = 0; i < PATTERN_STRIKES; ++i)
+	{
+		assert(!patterns.patterns[0].quarantined);
+		assert(pattern_exec(&patterns.patterns[0], evil, strlen(evil), v, 30) == PCRE_ERROR_MATCHLIMIT);
+	}
+	assert(patterns.patterns[0].quarantined);
+	assert(pattern_exec(&patterns.patterns[0], "aa.go:3", 7, v, 30) == PCRE_ERROR_NOMATCH);
 }
 
 int main(int argc, char const *argv[])
@@ -182,5 +1137,35 @@ int main(int argc, char const *argv[])
 
 	test_parse();
 
+	test_filter();
+
+	test_ansi();
+
+	test_seq();
+
+	test_study_chunks();
+
+	test_field_hash();
+
+	test_session();
+
+	test_report();
+
+	test_scan();
+
+	test_decompress();
+
+	test_gitindex();
+
+	test_daemon();
+
+	test_preview();
+
+	test_native();
+
+	test_windows();
+
+	test_quarantine();
+
 	return 0;
 }
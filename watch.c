@@ -0,0 +1,255 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "watch.h"
+
+// Files changed while the utility ran: this run's, and the previous run's
+static struct paths {
+	char** v;
+	size_t count;
+	size_t size;
+} ran[2];
+static int recording;
+
+static int
+compare_paths (const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Sorts paths, dropping any repeats
+static void
+paths_tidy (struct paths* paths)
+{
+	size_t i, n;
+
+	if (!paths->count)
+		return;
+	qsort(paths->v, paths->count, sizeof(*paths->v), compare_paths);
+	for (i = n = 1; i < paths->count; ++i) {
+		if (strcmp(paths->v[i], paths->v[n-1]))
+			paths->v[n++] = paths->v[i];
+		else
+			free(paths->v[i]);
+	}
+	paths->count = n;
+}
+
+#ifdef __linux__
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define MAX_WATCHES 8192
+
+// Directories by watch descriptor, to watch new subdirectories
+static char* watched[MAX_WATCHES];
+
+// A file rewritten over and over is only kept once
+static void
+paths_add (struct paths* paths, const char* path)
+{
+	char* copy;
+
+	if (paths->count == paths->size) {
+		paths_tidy(paths);
+		if (paths->count * 2 >= paths->size) {
+			paths->size = paths->size ? paths->size * 2 : 64;
+			paths->v = realloc(paths->v, paths->size * sizeof(*paths->v));
+			if (!paths->v) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+	}
+
+	if (!(copy = malloc(strlen(path)+1))) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(copy, path);
+	paths->v[paths->count++] = copy;
+}
+
+static int
+ignored (const char* name)
+{
+	size_t len = strlen(name);
+
+	if (name[0] == '.' || 0 == strcmp(name, "node_modules"))
+		return 1;
+
+	// Editor backup and swap files; 4913 is vim checking it can write
+	if (name[len-1] == '~' || 0 == strcmp(name, "4913"))
+		return 1;
+	if (len > 4 && (0 == strcmp(name+len-4, ".swp") || 0 == strcmp(name+len-4, ".swx")))
+		return 1;
+
+	return 0;
+}
+
+static void
+watch_dir (int fd, const char* dir)
+{
+	char path[PATH_MAX];
+	struct dirent* entry;
+	struct stat st;
+	DIR* d;
+	int wd;
+
+	if ((wd = inotify_add_watch(fd, dir, WATCH_EVENTS | IN_ONLYDIR)) < 0) {
+		if (errno == ENOSPC)
+			fprintf(stderr, "Warning: inotify watch limit reached at %s\n", dir);
+		return;
+	}
+
+	if (wd < MAX_WATCHES && !watched[wd]) {
+		watched[wd] = malloc(strlen(dir)+1);
+		strcpy(watched[wd], dir);
+	}
+
+	if (!(d = opendir(dir)))
+		return;
+
+	while ((entry = readdir(d)))
+	{
+		if (ignored(entry->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+			watch_dir(fd, path);
+	}
+
+	closedir(d);
+}
+
+int
+watch_init (const char* dir)
+{
+	int fd = inotify_init();
+
+	if (fd < 0) {
+		perror("inotify_init");
+		return -1;
+	}
+
+	watch_dir(fd, dir);
+
+	return fd;
+}
+
+int
+watch_changed (int fd)
+{
+	char buf[4096];
+	char path[PATH_MAX];
+	const struct inotify_event* event;
+	ssize_t n;
+	char* c;
+	int changed = 0;
+
+	if ((n = read(fd, buf, sizeof(buf))) <= 0)
+		return 0;
+
+	for (c = buf; c < buf + n; c += sizeof(*event) + event->len)
+	{
+		event = (const struct inotify_event*)c;
+
+		if (!event->len || ignored(event->name))
+			continue;
+
+		if (event->wd < MAX_WATCHES && watched[event->wd]) {
+			snprintf(path, sizeof(path), "%s/%s", watched[event->wd], event->name);
+			if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+				watch_dir(fd, path);
+			if (recording)
+				paths_add(&ran[0], path);
+		}
+
+		changed = 1;
+	}
+
+	return changed;
+}
+
+#else
+
+int
+watch_init (const char* dir)
+{
+	(void)dir;
+	fprintf(stderr, "\033[1mError\033[0m: watching for changes needs inotify\n");
+	return -1;
+}
+
+int
+watch_changed (int fd)
+{
+	(void)fd;
+	return 0;
+}
+
+#endif
+
+static int
+readable (int fd, long ms)
+{
+	struct timeval timeout;
+	fd_set fds;
+
+	timeout.tv_sec = ms / 1000;
+	timeout.tv_usec = (ms % 1000) * 1000;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+
+	return select(fd+1, &fds, NULL, NULL, &timeout) > 0;
+}
+
+void
+watch_settle (int fd)
+{
+	// Saving one file often means several events, or several files
+	while (readable(fd, WATCH_DELAY))
+		watch_changed(fd);
+}
+
+void
+watch_record (int fd)
+{
+	recording = 1;
+	watch_changed(fd);
+	recording = 0;
+}
+
+int
+watch_edited (int fd)
+{
+	struct paths previous;
+	size_t i;
+	int edited = 0;
+
+	while (readable(fd, 0))
+		watch_record(fd);
+
+	// Most of what a build writes, it writes every time.  A file the
+	// utility writes for the first time still costs one more run.
+	paths_tidy(&ran[0]);
+	for (i = 0; i < ran[0].count && !edited; ++i)
+		edited = !bsearch(&ran[0].v[i], ran[1].v, ran[1].count, sizeof(*ran[1].v), compare_paths);
+
+	previous = ran[1];
+	for (i = 0; i < previous.count; ++i)
+		free(previous.v[i]);
+	ran[1] = ran[0];
+	ran[0] = previous;
+	ran[0].count = 0;
+
+	return edited;
+}
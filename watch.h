@@ -0,0 +1,27 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#define WATCH_DELAY 200 // milliseconds without changes before a rerun
+
+// Watches dir and the directories below it (except hidden ones) for files
+// being written, created, moved or removed. Returns a descriptor which
+// becomes readable on changes, or -1.
+int watch_init (const char* dir);
+
+// Reads pending events, returning 1 if any of them were for source files
+// rather than editor swap files and the like.
+int watch_changed (int fd);
+
+// Waits until there have been no changes for WATCH_DELAY milliseconds
+void watch_settle (int fd);
+
+// Reads pending events while the utility runs, keeping the files changed
+// for watch_edited rather than reporting them
+void watch_record (int fd);
+
+// Once the utility has finished, returns 1 if any file changed while it ran
+// wasn't also written by its previous run, and so was likely edited
+// meanwhile.  What it wrote is kept for the next run.
+int watch_edited (int fd);
+
+#endif
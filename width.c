@@ -0,0 +1,163 @@
+#include <stdint.h>
+#include <string.h>
+#include "width.h"
+
+struct range {
+	unsigned long first;
+	unsigned long last;
+};
+
+// Non-spacing marks and format characters, which take no columns
+static const struct range zero_width[] = {
+	{ 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF },
+	{ 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A },
+	{ 0x064B, 0x065F }, { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+	{ 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 }, { 0x0730, 0x074A },
+	{ 0x07A6, 0x07B0 }, { 0x0900, 0x0902 }, { 0x093C, 0x093C }, { 0x0941, 0x0948 },
+	{ 0x094D, 0x094D }, { 0x0951, 0x0954 }, { 0x0962, 0x0963 }, { 0x0E31, 0x0E31 },
+	{ 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF },
+	{ 0x200B, 0x200F }, { 0x2028, 0x202E }, { 0x2060, 0x2064 }, { 0x20D0, 0x20FF },
+	{ 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF }, { 0xE0100, 0xE01EF },
+};
+
+// East Asian wide and fullwidth characters, and emoji presentation
+static const struct range double_width[] = {
+	{ 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+	{ 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 },
+	{ 0x2648, 0x2653 }, { 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+	{ 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 }, { 0x26CE, 0x26CE },
+	{ 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+	{ 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+	{ 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 },
+	{ 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF },
+	{ 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x303E },
+	{ 0x3041, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF },
+	{ 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 },
+	{ 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x1F300, 0x1F64F },
+	{ 0x1F680, 0x1F6FF }, { 0x1F900, 0x1F9FF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+// Sequence length by lead byte; 0 for bytes which can’t start a sequence
+static const unsigned char utf8_length[256] = {
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+	3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3, 4,4,4,4,4,0,0,0,0,0,0,0,0,0,0,0,
+};
+
+static const unsigned long utf8_minimum[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+static int
+in_table (unsigned long cp, const struct range* table, size_t n)
+{
+	size_t lo = 0, hi = n;
+
+	if (cp < table[0].first || cp > table[n-1].last)
+		return 0;
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (cp > table[mid].last)
+			lo = mid + 1;
+		else if (cp < table[mid].first)
+			hi = mid;
+		else
+			return 1;
+	}
+
+	return 0;
+}
+
+int
+codepoint_width (unsigned long cp)
+{
+	if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0))
+		return 0;
+	if (cp < 0x300)
+		return 1;
+
+	if (in_table(cp, zero_width, sizeof(zero_width)/sizeof(*zero_width)))
+		return 0;
+	if (in_table(cp, double_width, sizeof(double_width)/sizeof(*double_width)))
+		return 2;
+
+	return 1;
+}
+
+int
+utf8_decode (const char* s, const char* end, unsigned long* cp)
+{
+	const unsigned char* u = (const unsigned char*)s;
+	int length = utf8_length[u[0]];
+	int i;
+
+	*cp = 0xFFFD;
+
+	if (length <= 1) {
+		if (length == 1)
+			*cp = u[0];
+		return 1;
+	}
+
+	*cp = u[0] & (0x7f >> length);
+	for (i = 1; i < length; ++i)
+	{
+		if (s + i >= end)
+			return 0;
+		if ((u[i] & 0xc0) != 0x80) {
+			*cp = 0xFFFD;
+			return 1;
+		}
+		*cp = (*cp << 6) | (u[i] & 0x3f);
+	}
+
+	if (*cp < utf8_minimum[length] || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) {
+		*cp = 0xFFFD;
+		return 1;
+	}
+
+	return length;
+}
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// Flags any byte in the word with the high bit set, below 0x20, or DEL
+static uint64_t
+word_special (uint64_t x)
+{
+	uint64_t del = x ^ (ONES * 0x7f);
+
+	return (x | ((x - ONES * 0x20) & ~x) | ((del - ONES) & ~del)) & HIGHS;
+}
+
+// Checks eight bytes at a time, which keeps wrapping plain ASCII output
+// about as cheap as counting bytes.
+size_t
+ascii_span (const char* s, const char* end, size_t limit)
+{
+	const char* start = s;
+	uint64_t word;
+
+	while (limit >= sizeof(word) && end - s >= (ptrdiff_t)sizeof(word))
+	{
+		memcpy(&word, s, sizeof(word));
+		if (word_special(word))
+			break;
+		s += sizeof(word);
+		limit -= sizeof(word);
+	}
+
+	while (limit > 0 && s < end && *s >= 0x20 && *s < 0x7f)
+	{
+		++s;
+		--limit;
+	}
+
+	return s - start;
+}
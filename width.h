@@ -0,0 +1,18 @@
+#ifndef WIDTH_H
+#define WIDTH_H
+
+#include <stddef.h>
+
+#define TAB_WIDTH 8
+
+// Number of terminal columns taken by a code point: 0, 1 or 2
+int codepoint_width (unsigned long cp);
+
+// Decodes the UTF-8 sequence at s, returning its length in bytes.
+// Invalid bytes decode as a single U+FFFD; 0 means the sequence is cut short by end.
+int utf8_decode (const char* s, const char* end, unsigned long* cp);
+
+// Length of the run of printable ASCII starting at s, up to limit bytes
+size_t ascii_span (const char* s, const char* end, size_t limit);
+
+#endif